@@ -3,6 +3,7 @@ TEMPLATE = app
 # Make sure we do not accidentally #include files placed in 'res'
 CONFIG += no_include_pwd
 CONFIG += console
+CONFIG += thread
 CONFIG -= app_bundle
 
 SOURCES += $$PWD/src/*.cpp
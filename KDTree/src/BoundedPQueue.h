@@ -50,12 +50,15 @@
  * can be queried using the best() and worst() functions, which
  * return the smallest and largest priorities in the queue,
  * respectively.
+ *
+ * All the storage the queue needs is allocated by the constructor,
+ * so enqueuing and dequeuing never allocate memory.
  */
 
 #ifndef BOUNDED_PQUEUE_INCLUDED
 #define BOUNDED_PQUEUE_INCLUDED
 
-#include <map>
+#include <vector>
 #include <algorithm>
 #include <limits>
 
@@ -122,11 +125,34 @@ public:
     double best()  const;
     double worst() const;
 
+    // void reset(size_t maxSize);
+    // Usage: bpq.reset(10);
+    // --------------------------------------------------
+    // Empties the queue and changes its maximum size. The
+    // storage the queue has is kept, so this allocates
+    // nothing unless maxSize is above every size before.
+    void reset(size_t maxSize);
+
 private:
-    // This class is layered on top of a multimap mapping from priorities
-    // to elements with those priorities.
-    multimap<double, T> elems;
+    // This class is layered on top of a max-heap of elements stored in a
+    // vector that is allocated once, with room for maxSize elements. Elements
+    // with equal priorities are ordered by when they were enqueued, so they
+    // come out first-in first-out and the newest one is ejected first.
+    struct Entry {
+        double priority;
+        size_t order;
+        T value;
+
+        bool operator<(const Entry& other) const {
+            if (priority != other.priority) return priority < other.priority;
+            return order < other.order;
+        }
+    };
+
+    vector<Entry> elems;
     size_t maximumSize;
+    size_t enqueued;        // Number of enqueue calls so far, for tie-breaking
+    bool sorted;            // Whether elems is sorted from worst to best
 };
 
 /** BoundedPQueue class implementation details */
@@ -134,37 +160,53 @@ private:
 template <typename T>
 BoundedPQueue<T>::BoundedPQueue(size_t maxSize) {
     maximumSize = maxSize;
+    enqueued = 0;
+    sorted = true;
+    elems.reserve(maxSize);
 }
 
-// enqueue adds the element to the map, then deletes the last element of the
-// map if there size exceeds the maximum size.
+// enqueue adds the element to the heap, or if the heap is full, replaces the
+// worst element with it when it is better than that element.
 template <typename T>
 void BoundedPQueue<T>::enqueue(const T& value, double priority) {
-    // Add the element to the collection.
-    elems.insert(make_pair(priority, value));
-    
-    // If there are too many elements in the queue, drop off the last one.
-    if (size() > maxSize()) {
-        typename multimap<double, T>::iterator last = elems.end();
-        --last; // Now points to highest-priority element
-        elems.erase(last);
+    Entry entry = {priority, enqueued++, value};
+
+    if (size() < maxSize()) {
+        elems.push_back(entry);
+        push_heap(elems.begin(), elems.end());
+    } else if (!elems.empty() && entry < elems.front()) {
+        // Drop off the worst element (the root of the heap) to make room.
+        pop_heap(elems.begin(), elems.end());
+        elems.back() = entry;
+        push_heap(elems.begin(), elems.end());
+    } else {
+        // The new element would be the one ejected.
+        return;
     }
+    sorted = false;
 }
 
-// dequeueMin copies the lowest element of the map (the one pointed at by
-// begin()) and then removes it.
+// dequeueMin sorts the heap from worst to best the first time it is called
+// after an enqueue, which keeps it a valid max-heap, and then takes elements
+// off the back of the vector.
 template <typename T>
 T BoundedPQueue<T>::dequeueMin() {
+    if (!sorted) {
+        sort_heap(elems.begin(), elems.end());
+        reverse(elems.begin(), elems.end());
+        sorted = true;
+    }
+
     // Copy the best value.
-    T result = elems.begin()->second;
-    
-    // Remove it from the map.
-    elems.erase(elems.begin());
-    
+    T result = elems.back().value;
+
+    // Remove it from the heap.
+    elems.pop_back();
+
     return result;
 }
 
-// size() and empty() call directly down to the underlying map.
+// size() and empty() call directly down to the underlying vector.
 template <typename T>
 size_t BoundedPQueue<T>::size() const {
     return elems.size();
@@ -182,15 +224,30 @@ size_t BoundedPQueue<T>::maxSize() const {
 }
 
 // The best() and worst() functions check if the queue is empty,
-// and if so return infinity.
+// and if so return infinity. The worst element is the root of the heap,
+// while the best one is at the back once sorted, or else is one of the
+// leaves, which make up the second half of the heap.
 template <typename T>
 double BoundedPQueue<T>::best() const {
-    return empty()? numeric_limits<double>::infinity() : elems.begin()->first;
+    if (empty()) return numeric_limits<double>::infinity();
+    if (sorted) return elems.back().priority;
+
+    typename vector<Entry>::const_iterator leaves = elems.begin() + elems.size() / 2;
+    return min_element(leaves, elems.end())->priority;
 }
 
 template <typename T>
 double BoundedPQueue<T>::worst() const {
-    return empty()? numeric_limits<double>::infinity() : elems.rbegin()->first;
+    return empty()? numeric_limits<double>::infinity() : elems.front().priority;
+}
+
+template <typename T>
+void BoundedPQueue<T>::reset(size_t maxSize) {
+    elems.clear();
+    elems.reserve(maxSize);
+    maximumSize = maxSize;
+    enqueued = 0;
+    sorted = true;
 }
 
 #endif // BOUNDED_PQUEUE_INCLUDED
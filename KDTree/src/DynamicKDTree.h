@@ -0,0 +1,615 @@
+/**
+ * File: DynamicKDTree.h
+ * ------------------------
+ * A kd-tree for high rates of inserts, kept as a forest of static KDTrees
+ * (the logarithmic method of Bentley and Saxe).
+ *
+ * New points go into a small buffer. Once the buffer is full it is built into
+ * a KDTree of its own, and whenever two trees of the same size lie next to
+ * each other in the forest, a background thread merges them into one tree
+ * twice as big. Every tree comes from the median build, so each one is
+ * perfectly balanced, and n points take O(log n) trees. A point takes part in
+ * O(log n) builds over its life, so inserting costs O(log^2 n) amortized, all
+ * of it spent in bulk builds; a query searches every tree and merges the
+ * results.
+ *
+ * DynamicKDTree<3, int> dyn;
+ * dyn.insert(pt, 137);          // Visible to every query from here on
+ * int value = dyn.kNNValue(key, 5);
+ *
+ * Queries may run on any number of threads while points are inserted, and
+ * see every point inserted before they started. Inserting a point that is
+ * already there replaces its value: the newest copy of a point hides the
+ * older ones, which are dropped when the trees holding them are merged.
+ */
+
+#ifndef DYNAMIC_KDTREE_INCLUDED
+#define DYNAMIC_KDTREE_INCLUDED
+
+#include "KDTree.h"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
+#include <limits>
+#include <exception>
+
+using namespace std;
+
+template <size_t N, typename ElemType, typename CoordType = double>
+class DynamicKDTree {
+public:
+    typedef KDTree<N, ElemType, allocator<ElemType>, CoordType> Tree;
+    typedef typename Tree::KDPair KDPair;
+    typedef KDNeighbor<N, ElemType, CoordType> Neighbor;
+
+    // Constructor: DynamicKDTree(size_t bufferSize = 1024, size_t mergeThreads = 1);
+    // Usage: DynamicKDTree<3, int> dyn(4096, 2);
+    // ----------------------------------------------------
+    // Constructs an empty DynamicKDTree that builds a tree out of every
+    // bufferSize points inserted, and merges trees on mergeThreads threads
+    // of its own (at least one).
+    explicit DynamicKDTree(size_t bufferSize = 1024, size_t mergeThreads = 1);
+
+    // Destructor: ~DynamicKDTree();
+    // Usage: (implicit)
+    // ----------------------------------------------------
+    // Stops the merge threads, after they finish the merges they are in.
+    ~DynamicKDTree();
+
+    // size_t dimension() const;
+    // Usage: size_t dim = dyn.dimension();
+    // ----------------------------------------------------
+    // Returns the dimension of the points stored in this DynamicKDTree.
+    size_t dimension() const;
+
+    // size_t size() const;
+    // bool empty() const;
+    // Usage: if (dyn.empty())
+    // ----------------------------------------------------
+    // Returns the number of points in the forest and whether it is empty.
+    // A point that was inserted again is counted twice until its two copies
+    // end up in the same tree.
+    size_t size() const;
+    bool empty() const;
+
+    // void insert(const Point<N, CoordType>& pt, const ElemType& value);
+    // Usage: dyn.insert(v, "This value is associated with v.");
+    // ----------------------------------------------------
+    // Inserts the point pt, associating it with the specified value. If the
+    // point already existed, the new value hides the old one. When the
+    // merges fall far behind, this waits for them to catch up. If building
+    // a full buffer into a tree throws, insert passes the exception on; the
+    // points stay in the forest, and a later insert builds them again.
+    void insert(const Point<N, CoordType>& pt, const ElemType& value);
+
+    // bool contains(const Point<N, CoordType>& pt) const;
+    // Usage: if (dyn.contains(pt))
+    // ----------------------------------------------------
+    // Returns whether the specified point is in the forest.
+    bool contains(const Point<N, CoordType>& pt) const;
+
+    // ElemType at(const Point<N, CoordType>& pt) const;
+    // Usage: cout << dyn.at(v) << endl;
+    // ----------------------------------------------------
+    // Returns a copy of the value associated with the point pt. The trees
+    // holding it may be merged at any time, so no reference is handed out.
+    // If the point is not there, this function throws an out_of_range
+    // exception.
+    ElemType at(const Point<N, CoordType>& pt) const;
+
+    // ElemType kNNValue(const Point<N, CoordType>& key, size_t k,
+    //                   const KDSearchOptions& options = KDSearchOptions()) const;
+    // size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+    //                 const KDSearchOptions& options = KDSearchOptions()) const;
+    // Usage: cout << dyn.kNNValue(v, 3) << endl;
+    // ----------------------------------------------------
+    // The same searches as those of KDTree, run over the whole forest. Each
+    // tree is searched with options, so approximate searches keep the
+    // guarantees they have on a single KDTree.
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k,
+                      const KDSearchOptions& options = KDSearchOptions()) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // void flush();
+    // Usage: dyn.flush();
+    // ----------------------------------------------------
+    // Waits until the merge threads have nothing left to merge. If a merge
+    // threw, the merge threads stop merging until flush rethrows that
+    // exception, and then go back to merging, that pair included.
+    void flush();
+
+private:
+    // A tree of the forest. The forest is ordered from the newest tree to
+    // the oldest, and a tree at level i holds up to bufferSize * 2^i points,
+    // and more than half that from level 1 on. Merges only join neighbors,
+    // which keeps that order.
+    struct Slot {
+        shared_ptr<const Tree> tree;
+        size_t level;
+        bool merging;
+    };
+
+    // A neighbor found in one of the sources of a search, along with how
+    // new that source is (0 is the newest). The point and value stay where
+    // the source keeps them, so searching never copies a value.
+    struct Candidate {
+        double distance;
+        size_t age;
+        const Point<N, CoordType>* point;
+        const ElemType* value;
+        bool operator<(const Candidate& rhs) const {
+            if (distance != rhs.distance) return distance < rhs.distance;
+            return age < rhs.age;
+        }
+    };
+
+    void shutdown();
+    static shared_ptr<const Tree> buildTree(vector<KDPair>& newestFirst, size_t& dropped);
+    void nearestCandidates(const Point<N, CoordType>& key, size_t k, const KDSearchOptions& options,
+                           vector<Candidate>& candidates, vector<KDPair>& recent,
+                           vector<shared_ptr<const Tree> >& trees) const;
+    static void keepNearest(vector<Candidate>& candidates, size_t k);
+    static void collect(const Tree& tree, vector<KDPair>& out);
+    void sealBuffer(unique_lock<mutex>& guard);
+    void snapshot(vector<shared_ptr<const Tree> >& trees) const;
+    bool findMerge(size_t& pos) const;
+    size_t levelOf(const Tree& tree) const;
+    size_t treeLimit() const;
+    void mergeLoop();
+
+    size_t bufferSize;
+    size_t count;                   // Points inserted, less the copies dropped
+    vector<KDPair> buffer;          // Points not in a tree yet, oldest first
+    shared_ptr<const vector<KDPair> > sealed;   // A full buffer being built into a tree, oldest first
+    bool sealing;                   // Whether some insert is building sealed
+    vector<Slot> forest;            // The trees, newest first
+    size_t merges;                  // Merges in progress
+    exception_ptr error;            // First exception of a merge, until flush rethrows it
+    bool stopping;
+
+    mutable mutex lock;             // Guards everything above
+    condition_variable changed;     // Signalled when the forest changes
+    vector<thread> mergers;
+
+    DynamicKDTree(const DynamicKDTree&);
+    DynamicKDTree& operator=(const DynamicKDTree&);
+};
+
+/** DynamicKDTree class implementation details */
+
+template <size_t N, typename ElemType, typename CoordType>
+DynamicKDTree<N, ElemType, CoordType>::DynamicKDTree(size_t bufferSize, size_t mergeThreads) :
+        bufferSize(max<size_t>(bufferSize, 1)), count(0), sealing(false), merges(0), stopping(false) {
+    buffer.reserve(this->bufferSize);
+
+    try {
+        for (size_t i = 0; i < max<size_t>(mergeThreads, 1); ++i)
+            mergers.push_back(thread(&DynamicKDTree::mergeLoop, this));
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+DynamicKDTree<N, ElemType, CoordType>::~DynamicKDTree() {
+    shutdown();
+}
+
+// shutdown stops and joins the merge threads. It is also used when
+// starting them fails half way.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::shutdown() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (size_t i = 0; i < mergers.size(); ++i)
+        mergers[i].join();
+    mergers.clear();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t DynamicKDTree<N, ElemType, CoordType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t DynamicKDTree<N, ElemType, CoordType>::size() const {
+    lock_guard<mutex> guard(lock);
+    return count;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool DynamicKDTree<N, ElemType, CoordType>::empty() const {
+    return size() == 0;
+}
+
+// buildTree builds a tree from points listed newest first, keeping only the
+// newest copy of each point, and sets dropped to the number of older copies
+// left out.
+template <size_t N, typename ElemType, typename CoordType>
+shared_ptr<const typename DynamicKDTree<N, ElemType, CoordType>::Tree>
+DynamicKDTree<N, ElemType, CoordType>::buildTree(vector<KDPair>& newestFirst, size_t& dropped) {
+    // The sort is stable, so the newest copy of a point comes first
+    stable_sort(newestFirst.begin(), newestFirst.end(), [] (const KDPair& lhs, const KDPair& rhs) {
+        return lexicographical_compare(lhs.first.begin(), lhs.first.end(), rhs.first.begin(), rhs.first.end());
+    });
+    typename vector<KDPair>::iterator last = unique(newestFirst.begin(), newestFirst.end(),
+        [] (const KDPair& lhs, const KDPair& rhs) { return lhs.first == rhs.first; });
+    dropped = newestFirst.end() - last;
+
+    return make_shared<Tree>(make_move_iterator(newestFirst.begin()), make_move_iterator(last));
+}
+
+// collect appends every point of tree to out. A box spanning every value a
+// coordinate can take, infinities included, covers the whole tree.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::collect(const Tree& tree, vector<KDPair>& out) {
+    typedef numeric_limits<CoordType> Limits;
+    Point<N, CoordType> lo, hi;
+    for (size_t i = 0; i < N; ++i) {
+        lo[i] = Limits::has_infinity ? -Limits::infinity() : Limits::lowest();
+        hi[i] = Limits::has_infinity ? Limits::infinity() : Limits::max();
+    }
+    tree.rangeQuery(lo, hi, back_inserter(out));
+}
+
+// sealBuffer turns the buffer into the newest tree of the forest, or first
+// retries a sealed buffer whose build threw. The tree is built without
+// holding the lock, like a merge; until it is done the points stay in
+// sealed, where queries find them. Only one insert seals at a time, so the
+// tree is newer than every tree of the forest. The caller holds the lock
+// through guard.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::sealBuffer(unique_lock<mutex>& guard) {
+    if (!sealed) {
+        // The buffer gets fresh room for bufferSize points
+        vector<KDPair> full;
+        full.reserve(bufferSize);
+        full.swap(buffer);
+        sealed = make_shared<const vector<KDPair> >(move(full));
+    }
+    shared_ptr<const vector<KDPair> > points = sealed;
+    sealing = true;
+
+    try {
+        guard.unlock();
+        vector<KDPair> newestFirst(points->rbegin(), points->rend());
+        size_t dropped;
+        shared_ptr<const Tree> tree = buildTree(newestFirst, dropped);
+        Slot slot = {tree, levelOf(*tree), false};
+
+        guard.lock();
+        forest.insert(forest.begin(), slot);
+        sealed.reset();
+        count -= dropped;
+    } catch (...) {
+        if (!guard.owns_lock()) guard.lock();
+        sealing = false;
+        changed.notify_all();
+        throw;
+    }
+    sealing = false;
+    changed.notify_all();
+}
+
+// snapshot lists the trees of the forest, newest first, so that they can be
+// searched without holding the lock. The caller holds the lock.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::snapshot(vector<shared_ptr<const Tree> >& trees) const {
+    trees.reserve(forest.size());
+    for (size_t i = 0; i < forest.size(); ++i)
+        trees.push_back(forest[i].tree);
+}
+
+// findMerge looks for two neighboring trees that no thread is merging yet,
+// the newer one at the same level as the older one or above it, and sets pos
+// to the newer one. It takes the lowest level first, as those merges are the
+// cheapest, and the oldest pair of that level, so that trees of a level stay
+// behind the newer, smaller ones. A newer tree can only end up above an
+// older one when the merge of the older one is slow and the newer trees
+// merge past it; joining such a pair restores the order, so that the forest
+// never gets stuck with more trees than treeLimit and nothing to merge. The
+// caller holds the lock.
+template <size_t N, typename ElemType, typename CoordType>
+bool DynamicKDTree<N, ElemType, CoordType>::findMerge(size_t& pos) const {
+    bool found = false;
+    for (size_t i = 0; i + 1 < forest.size(); ++i) {
+        const Slot& newer = forest[i];
+        const Slot& older = forest[i + 1];
+        if (newer.merging || older.merging || newer.level < older.level) continue;
+        if (!found || newer.level <= forest[pos].level) {
+            pos = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// levelOf is the lowest level that has room for the points of tree. Older
+// copies of a point are dropped by merges, so a merged tree may stay at the
+// level of the pair. The level only depends on bufferSize, so the caller
+// need not hold the lock.
+template <size_t N, typename ElemType, typename CoordType>
+size_t DynamicKDTree<N, ElemType, CoordType>::levelOf(const Tree& tree) const {
+    size_t level = 0;
+    while ((bufferSize << level) < tree.size()) level++;
+    return level;
+}
+
+// treeLimit is how many trees the forest may hold before inserts wait for
+// the merges: two per level the points need, plus room for merges that
+// are under way. The caller holds the lock.
+template <size_t N, typename ElemType, typename CoordType>
+size_t DynamicKDTree<N, ElemType, CoordType>::treeLimit() const {
+    size_t levels = 1;
+    for (size_t trees = count / bufferSize; trees > 1; trees /= 2)
+        levels++;
+    return 2 * levels + 4;
+}
+
+// mergeLoop runs on every merge thread. It claims a pair of trees, merges
+// them without holding the lock, so inserts and queries go on meanwhile, and
+// then puts the merged tree in the place of the pair. A merge that throws
+// leaves the pair as it was and keeps the exception for flush; merging
+// stops until then, as retrying right away would most likely throw again.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::mergeLoop() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        size_t pos = 0;
+        changed.wait(guard, [&] { return stopping || (!error && findMerge(pos)); });
+        if (stopping) return;
+
+        forest[pos].merging = forest[pos + 1].merging = true;
+        shared_ptr<const Tree> newer = forest[pos].tree;
+        shared_ptr<const Tree> older = forest[pos + 1].tree;
+        merges++;
+        guard.unlock();
+
+        shared_ptr<const Tree> merged;
+        size_t dropped = 0;
+        exception_ptr failure;
+        try {
+            vector<KDPair> entries;
+            entries.reserve(newer->size() + older->size());
+            collect(*newer, entries);
+            collect(*older, entries);
+            merged = buildTree(entries, dropped);
+        } catch (...) {
+            failure = current_exception();
+        }
+
+        // New trees may have come in front of the pair since
+        guard.lock();
+        pos = 0;
+        while (forest[pos].tree != newer) ++pos;
+        if (failure) {
+            forest[pos].merging = forest[pos + 1].merging = false;
+            if (!error) error = failure;
+        } else {
+            Slot slot = {merged, levelOf(*merged), false};
+            forest[pos] = slot;
+            forest.erase(forest.begin() + pos + 1);
+            count -= dropped;
+        }
+        merges--;
+        changed.notify_all();
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::insert(const Point<N, CoordType>& pt, const ElemType& value) {
+    unique_lock<mutex> guard(lock);
+    buffer.push_back(KDPair(pt, value));
+    count++;
+    if (buffer.size() < bufferSize) return;
+
+    // Only add a tree once the merges keep up, or have stopped on an error
+    changed.wait(guard, [this] { return !sealing && (stopping || error || forest.size() < treeLimit()); });
+    if (sealed || buffer.size() >= bufferSize) sealBuffer(guard);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::flush() {
+    unique_lock<mutex> guard(lock);
+    size_t pos;
+    changed.wait(guard, [&] { return merges == 0 && !sealing && (error || !findMerge(pos)); });
+    if (error) {
+        exception_ptr failure = error;
+        error = exception_ptr();
+        changed.notify_all();
+        rethrow_exception(failure);
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool DynamicKDTree<N, ElemType, CoordType>::contains(const Point<N, CoordType>& pt) const {
+    vector<shared_ptr<const Tree> > trees;
+    {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (buffer[i].first == pt) return true;
+        }
+        for (size_t i = 0; sealed && i < sealed->size(); ++i) {
+            if ((*sealed)[i].first == pt) return true;
+        }
+        snapshot(trees);
+    }
+
+    for (size_t i = 0; i < trees.size(); ++i) {
+        if (trees[i]->contains(pt)) return true;
+    }
+    return false;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+ElemType DynamicKDTree<N, ElemType, CoordType>::at(const Point<N, CoordType>& pt) const {
+    vector<shared_ptr<const Tree> > trees;
+    {
+        // The newest copy of the point wins
+        lock_guard<mutex> guard(lock);
+        for (size_t i = buffer.size(); i-- > 0; ) {
+            if (buffer[i].first == pt) return buffer[i].second;
+        }
+        for (size_t i = sealed ? sealed->size() : 0; i-- > 0; ) {
+            if ((*sealed)[i].first == pt) return (*sealed)[i].second;
+        }
+        snapshot(trees);
+    }
+
+    for (size_t i = 0; i < trees.size(); ++i) {
+        if (trees[i]->contains(pt)) return trees[i]->at(pt);
+    }
+    throw out_of_range("No Point in DynamicKDTree");
+}
+
+// nearestCandidates asks the buffer and every tree for its k nearest points
+// and leaves the k nearest of all of them in candidates, nearest first. A
+// point may have older copies in older trees; a copy is at the same distance
+// as the newest one and sorts after it, so it is dropped when it comes up.
+// The trees are searched oldest first: the oldest are the biggest, and once
+// k neighbors are known, the k-th distance bounds the search of every later
+// tree, so the small ones mostly end at their root.
+// The buffer and a sealed buffer are searched point by point, as one list of
+// the newest points. The candidates point into the node arrays of the trees,
+// which trees keeps alive, and into recent, which holds copies of the points
+// found in that list since it may change as soon as the lock is released.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::nearestCandidates(const Point<N, CoordType>& key, size_t k,
+                                                              const KDSearchOptions& options,
+                                                              vector<Candidate>& candidates, vector<KDPair>& recent,
+                                                              vector<shared_ptr<const Tree> >& trees) const {
+    size_t bufferCount;
+    {
+        lock_guard<mutex> guard(lock);
+        size_t sealedCount = sealed ? sealed->size() : 0;
+        bufferCount = buffer.size() + sealedCount;
+
+        // The point of the given age in the buffer, then in sealed
+        auto newest = [&] (size_t age) -> const KDPair& {
+            if (age < buffer.size()) return buffer[buffer.size() - 1 - age];
+            return (*sealed)[bufferCount - 1 - age];
+        };
+
+        // Newer points of the buffer come first among equal distances
+        vector<pair<double, size_t> > nearest;
+        nearest.reserve(bufferCount);
+        for (size_t age = 0; age < bufferCount; ++age) {
+            double dist = Distance(newest(age).first, key);
+            if (dist <= options.maxDistance) nearest.push_back(make_pair(dist, age));
+        }
+        size_t keep = min(k, nearest.size());
+        partial_sort(nearest.begin(), nearest.begin() + keep, nearest.end());
+
+        // Reserved up front so the candidates can point into it
+        recent.reserve(keep);
+        for (size_t i = 0; i < keep; ++i) {
+            recent.push_back(newest(nearest[i].second));
+            Candidate found = {nearest[i].first, nearest[i].second, &recent.back().first, &recent.back().second};
+            candidates.push_back(found);
+        }
+        snapshot(trees);
+    }
+
+    KDSearchOptions bounded = options;
+    KNNQueryContext context;
+    for (size_t i = trees.size(); i-- > 0; ) {
+        if (candidates.size() == k) {
+            // Padded so that rounding cannot hide a newer copy of the k-th point
+            double kth = candidates.back().distance * (1 + 1e-9);
+            bounded.maxDistance = min(options.maxDistance, kth);
+        }
+        typename Tree::View view = trees[i]->view();
+        size_t age = bufferCount + i;
+        view.forEachNearest(key, k, context, bounded, [&] (NodeIndex node, double distance) {
+            Candidate next = {distance, age, &view.points[node], &view.elems[node]};
+            candidates.push_back(next);
+        });
+        keepNearest(candidates, k);
+    }
+    keepNearest(candidates, k);
+}
+
+// keepNearest sorts candidates, drops the older copies of every point and
+// keeps the k nearest of the rest.
+template <size_t N, typename ElemType, typename CoordType>
+void DynamicKDTree<N, ElemType, CoordType>::keepNearest(vector<Candidate>& candidates, size_t k) {
+    sort(candidates.begin(), candidates.end());
+
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size() && kept < k; ++i) {
+        const Candidate& next = candidates[i];
+        bool hidden = false;
+        for (size_t j = kept; j-- > 0 && candidates[j].distance == next.distance; )
+            hidden = hidden || *candidates[j].point == *next.point;
+        if (!hidden) candidates[kept++] = candidates[i];
+    }
+    candidates.resize(kept);
+}
+
+// Only the values of the k neighbors returned are copied.
+template <size_t N, typename ElemType, typename CoordType>
+size_t DynamicKDTree<N, ElemType, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                                       const KDSearchOptions& options) const {
+    neighbors.clear();
+    if (k == 0) return 0;
+
+    vector<Candidate> candidates;
+    vector<KDPair> recent;
+    vector<shared_ptr<const Tree> > trees;
+    nearestCandidates(key, k, options, candidates, recent, trees);
+
+    neighbors.resize(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        neighbors[i].point = *candidates[i].point;
+        neighbors[i].value = *candidates[i].value;
+        neighbors[i].distance = candidates[i].distance;
+    }
+    return neighbors.size();
+}
+
+// kNNValue counts the votes the way KDTree does, by sorting the positions of
+// the neighbors by value, and copies only the value it returns. On a tie the
+// value whose last vote came first in order of distance wins.
+template <size_t N, typename ElemType, typename CoordType>
+ElemType DynamicKDTree<N, ElemType, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                                         const KDSearchOptions& options) const {
+    if (k == 0) return ElemType();
+
+    vector<Candidate> candidates;
+    vector<KDPair> recent;
+    vector<shared_ptr<const Tree> > trees;
+    nearestCandidates(key, k, options, candidates, recent, trees);
+    if (candidates.empty()) return ElemType();
+
+    // Equal values end up next to each other, nearest first
+    vector<size_t> byValue(candidates.size());
+    for (size_t i = 0; i < byValue.size(); ++i) byValue[i] = i;
+    sort(byValue.begin(), byValue.end(), [&] (size_t one, size_t two) {
+        const ElemType& a = *candidates[one].value;
+        const ElemType& b = *candidates[two].value;
+        if (a < b) return true;
+        if (b < a) return false;
+        return one < two;
+    });
+
+    size_t best = 0, bestCount = 0;
+    for (size_t first = 0, last; first < byValue.size(); first = last) {
+        last = first + 1;
+        while (last < byValue.size() && !(*candidates[byValue[first]].value < *candidates[byValue[last]].value))
+            ++last;
+        if (last - first > bestCount || (last - first == bestCount && byValue[last - 1] < byValue[best])) {
+            best = last - 1;
+            bestCount = last - first;
+        }
+    }
+    return *candidates[byValue[best]].value;
+}
+
+#endif // DYNAMIC_KDTREE_INCLUDED
@@ -0,0 +1,317 @@
+/**
+ * File: FrozenKDTree.h
+ * ------------------------
+ * A read-only copy of a KDTree laid out for exact-match lookups. Freezing a
+ * built tree copies its points into an implicit tree: a perfectly balanced
+ * kd-tree whose inner nodes hold nothing but the coordinate they split at,
+ * and whose children are found from a node's index instead of links:
+ *
+ * FrozenKDTree<3, int> index(kd);                   // Once, after building kd
+ * if (index.contains(pt)) cout << index.at(pt) << endl;
+ *
+ * contains and at walk from the root to a leaf bucket like those of KDTree,
+ * but every step reads one coordinate from a small array rather than a whole
+ * node, and where the next node lies is known before the step finishes.
+ * Trees much larger than the caches spend most of their lookup time waiting
+ * on memory, and these lookups wait far less:
+ *
+ *  KD_LAYOUT_BFS   Inner nodes are stored level by level, so the children of
+ *                  node i are 2i + 1 and 2i + 2, and the descendants a few
+ *                  levels down share a cache line. Each step prefetches
+ *                  that line, which arrives while the levels in between are
+ *                  walked.
+ *  KD_LAYOUT_VEB   Inner nodes are stored in van Emde Boas order: the top
+ *                  half of the levels first, then each subtree hanging below
+ *                  them, every part laid out the same way in turn. A walk
+ *                  touches O(log_B n) blocks whatever the block size B, so
+ *                  cache lines, pages and TLB entries are all used well
+ *                  without tuning the layout to any of them.
+ *
+ * The frozen tree splits the dimensions in turn, exactly at the middle of
+ * its points. Points that share the coordinate a node splits on are ordered
+ * by their next coordinates, so the halves never differ by more than one
+ * point. A frozen tree keeps no link to the KDTree it was made from, which
+ * may change or go away afterwards.
+ */
+
+#ifndef FROZEN_KDTREE_INCLUDED
+#define FROZEN_KDTREE_INCLUDED
+
+#include "KDTree.h"
+#include <iterator>
+#include <limits>
+
+using namespace std;
+
+// How a FrozenKDTree orders its inner nodes
+enum KDLayout {
+    KD_LAYOUT_BFS,              // Level by level, with prefetching
+    KD_LAYOUT_VEB               // van Emde Boas order
+};
+
+template <size_t N, typename ElemType, typename CoordType = double>
+class FrozenKDTree {
+public:
+    typedef pair<Point<N, CoordType>, ElemType> KDPair;
+
+    // Constructor: FrozenKDTree(const KDTree<N, ElemType, Alloc, CoordType>& kd,
+    //                           KDLayout layout = KD_LAYOUT_BFS,
+    //                           size_t bucketSize = KDBuildOptions::DEFAULT_BUCKET_SIZE);
+    // Usage: FrozenKDTree<3, int> index(kd, KD_LAYOUT_VEB);
+    // ----------------------------------------------------
+    // Copies the points of kd and their values into a frozen tree with the
+    // given layout, whose leaf buckets hold up to bucketSize points.
+    template <typename Alloc>
+    explicit FrozenKDTree(const KDTree<N, ElemType, Alloc, CoordType>& kd, KDLayout layout = KD_LAYOUT_BFS,
+                          size_t bucketSize = KDBuildOptions::DEFAULT_BUCKET_SIZE);
+
+    // size_t dimension() const;
+    // size_t size() const;
+    // bool empty() const;
+    // bool contains(const Point<N, CoordType>& pt) const;
+    // Usage: if (index.contains(pt))
+    // ----------------------------------------------------
+    // The same as for KDTree.
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+    bool contains(const Point<N, CoordType>& pt) const;
+
+    // const ElemType& at(const Point<N, CoordType>& pt) const;
+    // Usage: cout << index.at(v) << endl;
+    // ----------------------------------------------------
+    // Returns a reference to the value associated with pt. If the point is
+    // not there, this function throws an out_of_range exception.
+    const ElemType& at(const Point<N, CoordType>& pt) const;
+
+    // KDLayout layout() const;
+    // Usage: if (index.layout() == KD_LAYOUT_VEB)
+    // ----------------------------------------------------
+    // Returns the layout of the inner nodes.
+    KDLayout layout() const;
+
+private:
+    // Most levels of inner nodes a tree of fewer than 2^32 points needs
+    const static size_t MAX_HEIGHT = 32;
+
+    // How many levels ahead the BFS layout prefetches: the nodes that far
+    // below a node are consecutive, and this many levels of them take up
+    // about a cache line
+    const static size_t PREFETCH_LEVELS = sizeof(CoordType) <= 2 ? 5 : sizeof(CoordType) <= 4 ? 4 : 3;
+
+    static bool before(const Point<N, CoordType>& one, const Point<N, CoordType>& two, size_t split);
+    void splitLevels(size_t rootDepth, size_t levels);
+    void place(vector<KDPair>& data, size_t first, size_t last, size_t depth, size_t path, size_t* pos);
+    size_t nodeAt(size_t depth, size_t path, const size_t* pos) const;
+    size_t search(const Point<N, CoordType>& pt) const;
+
+    KDLayout order;
+    size_t height;                  // Levels of inner nodes
+
+    // The points in leaf order, and the value of each point. The leaf a
+    // walk ends at is the range of them that is left after halving the
+    // whole range at every level.
+    vector<Point<N, CoordType> > points;
+    vector<ElemType> elems;
+
+    // The coordinate each inner node splits at. The node at depth d splits
+    // on dimension d % N, at the point in the middle of its range, which is
+    // kept whole in separators for the walks that tie with the key.
+    vector<CoordType> keys;
+    vector<Point<N, CoordType> > separators;
+
+    // Where the van Emde Boas layout puts the node at depth d, for d > 0:
+    // it is the root of one of the subtrees below a top part whose root is
+    // at depth topDepth[d], which spans topSize[d] nodes, and each of those
+    // subtrees spans bottomSize[d] nodes
+    size_t topDepth[MAX_HEIGHT];
+    size_t topSize[MAX_HEIGHT];
+    size_t bottomSize[MAX_HEIGHT];
+};
+
+/** FrozenKDTree class implementation details */
+
+// Starts loading the cache line at address without waiting for it, on
+// compilers that can
+#if defined(__GNUC__)
+#define FROZEN_KDTREE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define FROZEN_KDTREE_PREFETCH(address) ((void) (address))
+#endif
+
+template <size_t N, typename ElemType, typename CoordType>
+const size_t FrozenKDTree<N, ElemType, CoordType>::MAX_HEIGHT;
+
+template <size_t N, typename ElemType, typename CoordType>
+const size_t FrozenKDTree<N, ElemType, CoordType>::PREFETCH_LEVELS;
+
+// The constructor collects the points of kd with a range query over all of
+// space, which leaves out erased ones, and partitions them in place.
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Alloc>
+FrozenKDTree<N, ElemType, CoordType>::FrozenKDTree(const KDTree<N, ElemType, Alloc, CoordType>& kd, KDLayout layout,
+                                                   size_t bucketSize) : order(layout), height(0) {
+    typedef numeric_limits<CoordType> Limits;
+    Point<N, CoordType> lo, hi;
+    for (size_t i = 0; i < N; ++i) {
+        lo[i] = Limits::has_infinity ? -Limits::infinity() : Limits::lowest();
+        hi[i] = Limits::has_infinity ? Limits::infinity() : Limits::max();
+    }
+    vector<KDPair> data;
+    data.reserve(kd.size());
+    kd.rangeQuery(lo, hi, back_inserter(data));
+
+    // Enough levels that no leaf holds more than bucketSize points
+    bucketSize = max<size_t>(bucketSize, 1);
+    while (!data.empty() && ((data.size() - 1) >> height) + 1 > bucketSize)
+        ++height;
+
+    keys.resize((size_t(1) << height) - 1);
+    separators.resize(keys.size());
+    fill(topDepth, topDepth + MAX_HEIGHT, 0);
+    fill(topSize, topSize + MAX_HEIGHT, 0);
+    fill(bottomSize, bottomSize + MAX_HEIGHT, 0);
+    if (order == KD_LAYOUT_VEB) splitLevels(0, height);
+    size_t pos[MAX_HEIGHT];
+    if (height > 0) place(data, 0, data.size(), 0, 1, pos);
+
+    // Lay the data out in leaf order
+    points.reserve(data.size());
+    elems.reserve(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        points.push_back(data[i].first);
+        elems.push_back(std::move(data[i].second));
+    }
+}
+
+// before orders points by their coordinate along split, then by the ones
+// after it in turn. Distinct points are never equal under it.
+template <size_t N, typename ElemType, typename CoordType>
+bool FrozenKDTree<N, ElemType, CoordType>::before(const Point<N, CoordType>& one, const Point<N, CoordType>& two,
+                                                  size_t split) {
+    for (size_t i = 0; i < N; ++i, split = split + 1 == N ? 0 : split + 1) {
+        if (one[split] < two[split]) return true;
+        if (two[split] < one[split]) return false;
+    }
+    return false;
+}
+
+// splitLevels fills in the van Emde Boas tables for the levels from
+// rootDepth on: the top half of them (rounded down) comes first, then the
+// subtrees below it, and both are split the same way in turn.
+template <size_t N, typename ElemType, typename CoordType>
+void FrozenKDTree<N, ElemType, CoordType>::splitLevels(size_t rootDepth, size_t levels) {
+    if (levels <= 1) return;
+    size_t top = levels / 2;
+    size_t bottomRoot = rootDepth + top;
+    topDepth[bottomRoot] = rootDepth;
+    topSize[bottomRoot] = (size_t(1) << top) - 1;
+    bottomSize[bottomRoot] = (size_t(1) << (levels - top)) - 1;
+    splitLevels(rootDepth, top);
+    splitLevels(bottomRoot, levels - top);
+}
+
+// nodeAt returns where the node at depth is stored. path is the node's
+// number in breadth-first order counting from 1, whose bits below the
+// leading one are the turns taken to reach it (1 for right). The van Emde
+// Boas layout also needs pos, where the nodes above it on the walk are.
+template <size_t N, typename ElemType, typename CoordType>
+size_t FrozenKDTree<N, ElemType, CoordType>::nodeAt(size_t depth, size_t path, const size_t* pos) const {
+    if (order == KD_LAYOUT_BFS) return path - 1;
+    if (depth == 0) return 0;
+
+    // The last turns, below the top part, pick one of the subtrees
+    return pos[topDepth[depth]] + topSize[depth] + (path & topSize[depth]) * bottomSize[depth];
+}
+
+// place partitions data[first, last) for the node at depth and the nodes
+// below it. The middle point in the order of before goes to the right half,
+// and its coordinate becomes the node's key.
+template <size_t N, typename ElemType, typename CoordType>
+void FrozenKDTree<N, ElemType, CoordType>::place(vector<KDPair>& data, size_t first, size_t last, size_t depth,
+                                                 size_t path, size_t* pos) {
+    size_t node = nodeAt(depth, path, pos);
+    pos[depth] = node;
+
+    size_t split = depth % N;
+    size_t mid = first + (last - first) / 2;
+    nth_element(data.begin() + first, data.begin() + mid, data.begin() + last,
+                [=] (const KDPair& one, const KDPair& two) {return before(one.first, two.first, split);});
+    separators[node] = data[mid].first;
+    keys[node] = data[mid].first[split];
+
+    if (depth + 1 < height) {
+        place(data, first, mid, depth + 1, path * 2, pos);
+        place(data, mid, last, depth + 1, path * 2 + 1, pos);
+    }
+}
+
+// search walks down to the leaf pt belongs in and returns the position of
+// pt in points, or the number of points if it is not there. A point whose
+// coordinate equals a node's key is compared with the node's separator in
+// full, which is the only step that reads a point before the leaf.
+template <size_t N, typename ElemType, typename CoordType>
+size_t FrozenKDTree<N, ElemType, CoordType>::search(const Point<N, CoordType>& pt) const {
+    size_t first = 0, last = points.size();
+    size_t path = 1;
+    size_t pos[MAX_HEIGHT];
+    const CoordType *nodes = keys.data();
+
+    for (size_t depth = 0, split = 0; depth < height; ++depth, split = split + 1 == N ? 0 : split + 1) {
+        size_t node = nodeAt(depth, path, pos);
+        pos[depth] = node;
+        if (order == KD_LAYOUT_BFS) {
+            size_t ahead = (path << PREFETCH_LEVELS) - 1;
+            if (ahead < keys.size()) FROZEN_KDTREE_PREFETCH(nodes + ahead);
+        }
+
+        size_t mid = first + (last - first) / 2;
+        CoordType key = nodes[node];
+        bool right = key < pt[split] || (!(pt[split] < key) && !before(pt, separators[node], split));
+        if (right) {
+            first = mid;
+        } else {
+            last = mid;
+        }
+        path = path * 2 + right;
+    }
+
+    for (size_t i = first; i < last; ++i) {
+        if (points[i] == pt) return i;
+    }
+    return points.size();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t FrozenKDTree<N, ElemType, CoordType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t FrozenKDTree<N, ElemType, CoordType>::size() const {
+    return points.size();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool FrozenKDTree<N, ElemType, CoordType>::empty() const {
+    return points.empty();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+KDLayout FrozenKDTree<N, ElemType, CoordType>::layout() const {
+    return order;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool FrozenKDTree<N, ElemType, CoordType>::contains(const Point<N, CoordType>& pt) const {
+    return search(pt) != points.size();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+const ElemType& FrozenKDTree<N, ElemType, CoordType>::at(const Point<N, CoordType>& pt) const {
+    size_t found = search(pt);
+    if (found == points.size()) throw out_of_range("No Point in FrozenKDTree");
+    return elems[found];
+}
+
+#endif // FROZEN_KDTREE_INCLUDED
@@ -12,57 +12,268 @@
 
 #include "Point.h"
 #include "BoundedPQueue.h"
+#include "TaskPool.h"
 #include <stdexcept>
 #include <cmath>
-#include <stack>
 #include <map>
 #include <algorithm>
 #include <vector>
+#include <functional>
+#include <cstdint>
+#include <limits>
 
 // "using namespace" in a header file is conventionally frowned upon, but I'm
 // including it here so that you may use things like size_t without having to
 // type std::size_t every time.
 using namespace std;
 
-template <size_t N, typename ElemType>
-class KDTree;
+// Nodes of a KDTree are not allocated one by one. Node i of a tree is spread
+// over parallel arrays owned by the tree (its point, its value and its split
+// dimension are all stored at index i), and a KDNode only records the shape of
+// the tree as the 32-bit indices of its children in those arrays. The arrays
+// get their memory from the tree's allocator, which is std::allocator unless
+// another one is given as the third template argument. MyArena stands for
+// any allocator of your own here; the library does not provide one:
+//
+// KDTree<3, string, MyArena<string> > kd;
+//
+// The leaves of a tree are buckets of up to KDBuildOptions::bucketSize points
+// kept in consecutive slots, which searches scan one after another instead of
+// following a link per point. A bucket is a node whose left link is BUCKET;
+// its right field then holds the number of slots it spans, starting at its
+// own. Slots of a bucket that hold no point are marked as free.
+typedef uint32_t NodeIndex;
+
+struct KDNode {
+    NodeIndex left;
+    NodeIndex right;
+};
+
+// Left link of a node that is a bucket
+const NodeIndex BUCKET = UINT32_MAX - 1;
+
+// A point found by a nearest neighbor search, with its value and its
+// distance to the point searched for.
+template <size_t N, typename ElemType, typename CoordType = double>
+struct KDNeighbor {
+    Point<N, CoordType> point;
+    ElemType value;
+    double distance;
+};
+
+// How a KDTree picks the dimension each node splits on, and where along it.
+// Searches follow whatever split each node recorded, so the rules only
+// change the shape of the tree. Data that spreads far more along some
+// dimensions than others gets more compact cells from the adaptive rules.
+enum KDSplitRule {
+    KD_SPLIT_CYCLE,             // The dimensions in turn, at the median
+    KD_SPLIT_MAX_SPREAD,        // The dimension the points spread most along, at the median
+    KD_SPLIT_MAX_VARIANCE,      // The dimension of largest variance, at the median
+    KD_SPLIT_SLIDING_MIDPOINT   // The dimension of largest spread, at the middle of
+                                // the spread, moved up to the nearest point
+};
+
+// Options for building a KDTree from a range of data.
+struct KDBuildOptions {
+    // Threads used for the build, counting the calling thread.
+    // Zero means one per hardware thread.
+    size_t threads;
+
+    // Ranges of at most this many points are built serially
+    // rather than split into more tasks.
+    size_t serialCutoff;
+
+    // Most points a leaf bucket holds. The tree keeps it for the
+    // points inserted later, and for the subtrees it rebuilds.
+    size_t bucketSize;
+
+    // How nodes pick their split. Like the bucket size, the tree keeps it.
+    KDSplitRule splitRule;
+
+    // Whether the tree keeps the bounding box of every subtree, which
+    // nearest neighbor searches prune with instead of the split planes
+    // alone. It costs two more points per node, and pays off most on
+    // points of many dimensions.
+    bool boundingBoxes;
+
+    explicit KDBuildOptions(size_t numThreads = 1, size_t cutoff = 32768, size_t bucket = DEFAULT_BUCKET_SIZE,
+                            KDSplitRule rule = KD_SPLIT_CYCLE, bool boxes = false)
+        : threads(numThreads), serialCutoff(cutoff), bucketSize(bucket), splitRule(rule), boundingBoxes(boxes) {}
+
+    // Leaf bucket size of trees that are not given one
+    const static size_t DEFAULT_BUCKET_SIZE = 8;
+};
+
+// Options for nearest neighbor searches on a KDTree.
+struct KDSearchOptions {
+    // Approximation factor. A positive epsilon lets the search skip parts
+    // of the tree that cannot hold a neighbor more than (1 + epsilon) times
+    // closer than the ones found so far, so each neighbor returned is at
+    // most (1 + epsilon) times as far as the exact one. Zero is exact.
+    double epsilon;
+
+    // Upper bound on the number of points a search examines, which caps its
+    // cost; the best neighbors found by then are returned. Zero is no limit.
+    size_t maxChecks;
+
+    // Whether to search best-bin-first: rather than backtracking depth first,
+    // always explore the unvisited branch closest to the point searched for,
+    // so a limited search spends its checks where the neighbors likely are.
+    // On by default whenever maxChecks is set.
+    bool bestBinFirst;
+
+    // Only points at most this far from the point searched for count as
+    // neighbors, so a search may find fewer than k. Parts of the tree beyond
+    // it are never visited. Infinite by default.
+    double maxDistance;
+
+    explicit KDSearchOptions(double eps = 0, size_t checks = 0)
+        : epsilon(eps), maxChecks(checks), bestBinFirst(checks != 0),
+          maxDistance(numeric_limits<double>::infinity()) {}
+};
+
+// Working storage for nearest neighbor searches: the path a search
+// backtracks along, the branches best-bin-first has yet to explore, the
+// candidates found so far, and the buffers the majority vote of kNNValue
+// is counted in. A search given a context leaves all of it allocated for
+// the next one, so once a context has served a search with as large a k,
+// searches with it allocate nothing. A context may serve any tree, but
+// only one search at a time, so every thread needs its own.
+class KNNQueryContext {
+public:
+    KNNQueryContext() : bqueue(0) {}
 
-template <size_t N, typename ElemType>
-class KDNode{
 private:
-    Point<N> position;
-    ElemType element;
-    size_t split;   // the dimension to compare
-    KDNode *left;
-    KDNode *right;
-    KDNode(Point<N> pos, ElemType elem = ElemType(), size_t sp = 0, KDNode *le = NULL, KDNode *rt = NULL) : position(pos),
-            element(elem), split(sp), left(le), right(rt) {};
-
-    friend class KDTree<N, ElemType>;
+    template <size_t N, typename ElemType, typename CoordType> friend class KDTreeView;
+
+    typedef pair<double, NodeIndex> Branch;
+    vector<NodeIndex> path;
+    vector<Branch> branches;
+    BoundedPQueue<NodeIndex> bqueue;
+    vector<NodeIndex> nearest;      // The nodes found, nearest first
+    vector<NodeIndex> byValue;      // Positions in nearest, sorted by value
 };
 
 
-template <size_t N, typename ElemType>
+// A read-only view of the node arrays of a KDTree, wherever they are stored.
+// KDTree runs every search on a view of its own arrays, and MappedKDTree runs
+// the same searches on arrays mapped from a file. A view owns nothing, and is
+// only good as long as the arrays it points to do not change.
+template <size_t N, typename ElemType, typename CoordType = double>
+class KDTreeView {
+public:
+    typedef pair<Point<N, CoordType>, ElemType> KDPair;
+    typedef KDNeighbor<N, ElemType, CoordType> Neighbor;
+
+    // Index used for a missing child or an empty tree
+    const static NodeIndex NIL;
+
+    // The node arrays, as in KDTree, and the root of the tree in them
+    const Point<N, CoordType> *points;
+    const ElemType *elems;
+    const uint32_t *splits;
+    const KDNode *nodes;
+    const unsigned char *erased;
+    NodeIndex root;
+
+    // Points in the tree, erased ones left out
+    size_t sz;
+
+    // The corners of the bounding box of every subtree, or NULL when the
+    // tree keeps none
+    const Point<N, CoordType> *lower;
+    const Point<N, CoordType> *upper;
+
+    // NodeIndex find(const Point<N, CoordType>& pt) const;
+    // Usage: NodeIndex node = view.find(pt);
+    // ----------------------------------------------------
+    // Returns the node holding pt, or NIL if pt is not in the tree.
+    NodeIndex find(const Point<N, CoordType>& pt) const;
+
+    // The searches of KDTree, which documents them.
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k, const KDSearchOptions& options) const;
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                      const KDSearchOptions& options) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    const KDSearchOptions& options) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    KNNQueryContext& context, const KDSearchOptions& options) const;
+    vector<ElemType> kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads,
+                                   const KDSearchOptions& options) const;
+    size_t kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                         vector<Neighbor>& neighbors, size_t threads,
+                         const KDSearchOptions& options) const;
+    template <typename OutputIterator>
+    OutputIterator rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const;
+    size_t rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const;
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const;
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                size_t maxResults) const;
+
+private:
+    typedef KNNQueryContext::Branch Branch;
+
+    // Merges the nodes found in each tree of its forest
+    template <size_t M, typename E, typename C> friend class DynamicKDTree;
+
+    bool scanBucket(NodeIndex head, const Point<N, CoordType>& key, BoundedPQueue<NodeIndex>& bqueue,
+                    double bound, size_t& checksLeft) const;
+    double boxDistance(NodeIndex node, const Point<N, CoordType>& key) const;
+    void nearestNodes(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                      const KDSearchOptions& options) const;
+    void nearestNodesBestBin(const Point<N, CoordType>& key, KNNQueryContext& context,
+                             const KDSearchOptions& options) const;
+    ElemType majorityValue(KNNQueryContext& context) const;
+    size_t drainNeighbors(BoundedPQueue<NodeIndex>& bqueue, Neighbor* out) const;
+    template <typename Visitor>
+    void forEachNearest(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                        const KDSearchOptions& options, Visitor visit) const;
+    template <typename Visitor>
+    void forEachInRange(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, Visitor visit) const;
+    template <typename Visitor>
+    void forEachInRadius(const Point<N, CoordType>& key, double radius, Visitor visit) const;
+    template <typename Function>
+    void forEachQueryBatch(size_t count, size_t threads, Function run) const;
+};
+
+template <size_t N, typename ElemType, typename Alloc = allocator<ElemType>, typename CoordType = double>
 class KDTree {
 public:
 
     // Define ElemType to be value_type
     // for simplification
-    typedef pair<Point<N>, ElemType> KDPair;
+    typedef pair<Point<N, CoordType>, ElemType> KDPair;
     typedef typename vector<KDPair>::iterator KDIter;
+    typedef KDNeighbor<N, ElemType, CoordType> Neighbor;
 
     // Constructor: KDTree();
     // Usage: KDTree<3, int> myTree;
     // ----------------------------------------------------
     // Constructs an empty KDTree.
     KDTree();
-    
+
+    // Constructor: KDTree(const Alloc& alloc);
+    // Usage: KDTree<3, int, MyArena<int> > myTree(MyArena<int>(arena));   // Your own allocator
+    // ----------------------------------------------------
+    // Constructs an empty KDTree whose nodes are allocated with alloc.
+    explicit KDTree(const Alloc& alloc);
+
+    // Constructor: KDTree(const KDBuildOptions& options, const Alloc& alloc = Alloc());
+    // Usage: KDTree<3, int> myTree(KDBuildOptions(1, 32768, 32));
+    // ----------------------------------------------------
+    // Constructs an empty KDTree whose leaf buckets hold up to
+    // options.bucketSize points, which splits them by options.splitRule,
+    // and which keeps bounding boxes if options.boundingBoxes is set.
+    explicit KDTree(const KDBuildOptions& options, const Alloc& alloc = Alloc());
+
     // Destructor: ~KDTree()
     // Usage: (implicit)
     // ----------------------------------------------------
     // Cleans up all resources used by the KDTree.
     ~KDTree();
-    
+
     // KDTree(const KDTree& rhs);
     // KDTree& operator=(const KDTree& rhs);
     // Usage: KDTree<3, int> one = two;
@@ -72,17 +283,39 @@ public:
     KDTree(const KDTree& rhs);
     KDTree& operator=(const KDTree& rhs);
 
+    // KDTree(KDTree&& rhs);
+    // KDTree& operator=(KDTree&& rhs);
+    // Usage: KDTree<3, int> one = std::move(two);
+    // Usage: one = makeTree();
+    // -----------------------------------------------------
+    // Moves the contents of another KDTree into this one in constant time,
+    // leaving the other tree empty.
+    KDTree(KDTree&& rhs) noexcept;
+    KDTree& operator=(KDTree&& rhs);
+
     // Build KDTree from a bunch of data
-    // Need to sort and split to make the tree balanced
+    // Splits each range at its median to make the tree balanced,
+    // in O(n log n) time and without copying the data per level.
+    // (KDBuildOptions may pick other split rules.)
+    // Given move iterators, the values are moved into the tree.
     template <typename InputIterator>
     KDTree(InputIterator first, InputIterator last);
-    
+
+    // KDTree(InputIterator first, InputIterator last, const KDBuildOptions& options);
+    // Usage: KDTree<3, int> kd(data.begin(), data.end(), KDBuildOptions(8));
+    // ----------------------------------------------------
+    // Builds the KDTree from a bunch of data as above, using the given
+    // options. With several threads the subtrees are built in parallel, and
+    // the tree is exactly the one the single-threaded build produces.
+    template <typename InputIterator>
+    KDTree(InputIterator first, InputIterator last, const KDBuildOptions& options);
+
     // size_t dimension() const;
     // Usage: size_t dim = kd.dimension();
     // ----------------------------------------------------
     // Returns the dimension of the points stored in this KDTree.
     size_t dimension() const;
-    
+
     // size_t size() const;
     // bool empty() const;
     // Usage: if (kd.empty())
@@ -91,426 +324,1994 @@ public:
     // empty.
     size_t size() const;
     bool empty() const;
-    
-    // bool contains(const Point<N>& pt) const;
+
+    // size_t height() const;
+    // Usage: size_t levels = kd.height();
+    // ----------------------------------------------------
+    // Returns the number of nodes on the longest path from the root down to
+    // a leaf bucket, counting the bucket as one: the most nodes a search
+    // for a single point visits. An empty tree has height 0.
+    size_t height() const;
+
+    // void reserve(size_t count);
+    // Usage: kd.reserve(1000000);
+    // ----------------------------------------------------
+    // Makes room for count nodes in total, so that inserting up to that
+    // many points does not allocate again.
+    void reserve(size_t count);
+
+    // Alloc get_allocator() const;
+    // Usage: Alloc alloc = kd.get_allocator();
+    // ----------------------------------------------------
+    // Returns the allocator the nodes of the KDTree come from.
+    Alloc get_allocator() const;
+
+    // bool contains(const Point<N, CoordType>& pt) const;
     // Usage: if (kd.contains(pt))
     // ----------------------------------------------------
     // Returns whether the specified point is contained in the KDTree.
-    bool contains(const Point<N>& pt) const;
-    
-    // void insert(const Point<N>& pt, const ElemType& value);
+    bool contains(const Point<N, CoordType>& pt) const;
+
+    // void insert(const Point<N, CoordType>& pt, const ElemType& value);
     // Usage: kd.insert(v, "This value is associated with v.");
     // ----------------------------------------------------
     // Inserts the point pt into the KDTree, associating it with the specified
     // value. If the element already existed in the tree, the new value will
-    // overwrite the existing one.
-    void insert(const Point<N>& pt, const ElemType& value);
-    
-    // ElemType& operator[](const Point<N>& pt);
+    // overwrite the existing one. Subtrees that grow lopsided are rebuilt
+    // along the way, so the tree stays O(log n) deep in whatever order the
+    // points arrive.
+    void insert(const Point<N, CoordType>& pt, const ElemType& value);
+
+    // void insert(const Point<N, CoordType>& pt, ElemType&& value);
+    // Usage: kd.insert(v, std::move(payload));
+    // ----------------------------------------------------
+    // Same as above, but moves value into the KDTree.
+    void insert(const Point<N, CoordType>& pt, ElemType&& value);
+
+    // ElemType& emplace(const Point<N, CoordType>& pt, Args&&... args);
+    // Usage: kd.emplace(v, 10, 'x');
+    // ----------------------------------------------------
+    // Constructs the value associated with pt in place from args, replacing
+    // the existing value if pt is already in the KDTree, and returns a
+    // reference to it.
+    template <typename... Args>
+    ElemType& emplace(const Point<N, CoordType>& pt, Args&&... args);
+
+    // ElemType& operator[](const Point<N, CoordType>& pt);
     // Usage: kd[v] = "Some Value";
     // ----------------------------------------------------
     // Returns a reference to the value associated with point pt in the KDTree.
     // If the point does not exist, then it is added to the KDTree using the
     // default value of ElemType as its key.
-    ElemType& operator[](const Point<N>& pt);
-    
-    // ElemType& at(const Point<N>& pt);
-    // const ElemType& at(const Point<N>& pt) const;
+    ElemType& operator[](const Point<N, CoordType>& pt);
+
+    // ElemType& at(const Point<N, CoordType>& pt);
+    // const ElemType& at(const Point<N, CoordType>& pt) const;
     // Usage: cout << kd.at(v) << endl;
     // ----------------------------------------------------
     // Returns a reference to the key associated with the point pt. If the point
     // is not in the tree, this function throws an out_of_range exception.
-    ElemType& at(const Point<N>& pt);
-    const ElemType& at(const Point<N>& pt) const;
-    
-    // ElemType kNNValue(const Point<N>& key, size_t k) const
+    ElemType& at(const Point<N, CoordType>& pt);
+    const ElemType& at(const Point<N, CoordType>& pt) const;
+
+    // bool erase(const Point<N, CoordType>& pt);
+    // Usage: if (kd.erase(v))
+    // ----------------------------------------------------
+    // Removes the point pt and its value from the KDTree, and returns whether
+    // it was there. The node is only marked as erased; once erased nodes make
+    // up more than half of a subtree, that subtree is rebuilt from the points
+    // still in it, so erasing takes O(log n) amortized time and searches do
+    // not slow down as points come and go.
+    bool erase(const Point<N, CoordType>& pt);
+
+    // ElemType kNNValue(const Point<N, CoordType>& key, size_t k,
+    //                   const KDSearchOptions& options = KDSearchOptions()) const
     // Usage: cout << kd.kNNValue(v, 3) << endl;
     // ----------------------------------------------------
     // Given a point v and an integer k, finds the k points in the KDTree
     // nearest to v and returns the most common value associated with those
     // points. In the event of a tie, one of the most frequent value will be
-    // chosen.
-    ElemType kNNValue(const Point<N>& key, size_t k) const;
+    // chosen. The options may trade exactness for speed (see KDSearchOptions);
+    // by default the search is exact.
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k,
+                      const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+    //                 const KDSearchOptions& options = KDSearchOptions()) const;
+    // Usage: kd.kNearest(v, 3, neighbors);
+    // ----------------------------------------------------
+    // Finds the k points in the KDTree nearest to key and stores them in
+    // neighbors, nearest first, each with its value and its distance to key.
+    // The buffer is resized to the number of neighbors found, min(k, size()),
+    // which is also returned; its storage is reused between calls.
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // ElemType kNNValue(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+    //                   const KDSearchOptions& options = KDSearchOptions()) const;
+    // size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+    //                 KNNQueryContext& context, const KDSearchOptions& options = KDSearchOptions()) const;
+    // Usage: KNNQueryContext context;   // One per thread, kept between queries
+    //        label = kd.kNNValue(v, 3, context);
+    // ----------------------------------------------------
+    // The same searches, run in the storage of context instead of storage of
+    // their own. Once the context and the neighbors buffer have served a
+    // search with as large a k, these allocate no memory at all (as long as
+    // copying a value does not).
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                      const KDSearchOptions& options = KDSearchOptions()) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    KNNQueryContext& context, const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // vector<ElemType> kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads = 0,
+    //                                const KDSearchOptions& options = KDSearchOptions()) const;
+    // Usage: vector<string> labels = kd.kNNValueBatch(queries, 5);
+    // ----------------------------------------------------
+    // Runs kNNValue for every point in keys, spread over the given number of
+    // threads (zero means one per hardware thread). Element i of the result
+    // is exactly kd.kNNValue(keys[i], k, options).
+    vector<ElemType> kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads = 0,
+                                   const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // size_t kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+    //                      vector<Neighbor>& neighbors, size_t threads = 0,
+    //                      const KDSearchOptions& options = KDSearchOptions()) const;
+    // Usage: size_t stride = kd.kNearestBatch(queries, 5, neighbors);
+    // ----------------------------------------------------
+    // Finds the k points nearest to every point in keys, spread over the
+    // given number of threads. Returns min(k, size()), the length of the row
+    // each key gets; the neighbors of keys[i] are stored nearest first in
+    // neighbors[i * stride] up to neighbors[(i + 1) * stride]. A search cut
+    // short by maxChecks or maxDistance can find fewer than stride points,
+    // and the rest of its row is filled with neighbors whose distance is
+    // infinity (and whose point and value are value-initialized).
+    size_t kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                         vector<Neighbor>& neighbors, size_t threads = 0,
+                         const KDSearchOptions& options = KDSearchOptions()) const;
+
+    // OutputIterator rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const;
+    // Usage: kd.rangeQuery(lo, hi, back_inserter(found));
+    // ----------------------------------------------------
+    // Writes a KDPair for every point of the KDTree inside the axis-aligned
+    // box with corners lo and hi (boundaries included) to out, and returns
+    // the iterator past the last one written. The points come in no
+    // particular order.
+    template <typename OutputIterator>
+    OutputIterator rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const;
+
+    // size_t rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const;
+    // Usage: size_t inside = kd.rangeCount(lo, hi);
+    // ----------------------------------------------------
+    // Returns the number of points rangeQuery would find, without copying
+    // any of them.
+    size_t rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const;
+
+    // OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const;
+    // OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+    //                             size_t maxResults) const;
+    // Usage: kd.radiusSearch(v, 0.5, back_inserter(neighbors));
+    // ----------------------------------------------------
+    // Writes a Neighbor for every point of the KDTree within distance radius
+    // of key (boundary included) to out, and returns the iterator past the
+    // last one written. A point is written exactly when the distance written
+    // with it is at most radius, rounding included. The neighbors come in no particular order. The second
+    // version stops once it has written maxResults neighbors, which are then
+    // some of the points in the ball, not necessarily the nearest ones.
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const;
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                size_t maxResults) const;
 
 private:
-    KDNode<N, ElemType>* modify_search(const Point<N>& pt, int &direction);
-    KDNode<N, ElemType>* search(const Point<N>& pt) const;
-    void Destroy(KDNode<N, ElemType>* node);
-    KDNode<N, ElemType>* Clone(KDNode<N, ElemType>* other);
+    KDTree(const KDTree& rhs, const Alloc& alloc);
+
+    // Searches only read the node arrays, through a view of them
+    typedef KDTreeView<N, ElemType, CoordType> View;
+    View view() const;
+
+    // Writes the node arrays to a file
+    template <size_t M, typename E, typename C> friend class MappedKDTree;
+    // Searches the node arrays of every tree of its forest
+    template <size_t M, typename E, typename C> friend class DynamicKDTree;
+
+    NodeIndex descend(const Point<N, CoordType>& pt, NodeIndex& last) const;
+    NodeIndex search(const Point<N, CoordType>& pt) const;
+    template <typename... Args>
+    NodeIndex appendSlot(const Point<N, CoordType>& pt, unsigned char state, Args&&... args);
+    size_t appendFree(const Point<N, CoordType>& pt, size_t count, true_type);
+    size_t appendFree(const Point<N, CoordType>& pt, size_t count, false_type);
+    template <typename... Args>
+    NodeIndex newBucket(const Point<N, CoordType>& pt, size_t split, Args&&... args);
+    template <typename... Args>
+    NodeIndex splitBucket(NodeIndex head, const Point<N, CoordType>& pt, NodeIndex& slot, Args&&... args);
+    template <typename... Args>
+    NodeIndex addToBucket(NodeIndex head, const Point<N, CoordType>& pt, NodeIndex& slot, Args&&... args);
+    template <typename... Args>
+    NodeIndex findOrCreate(const Point<N, CoordType>& pt, bool& created, Args&&... args);
+    template <typename Visitor>
+    void walkPath(const Point<N, CoordType>& pt, Visitor visit);
+    NodeIndex rebuildSubtree(const Point<N, CoordType>& pt, NodeIndex top, KDPair* extra = NULL);
+    void rebuildAll(KDPair* extra = NULL);
+    void fitBox(NodeIndex node);
+    void fitBoxes(NodeIndex top);
+    void extendBox(NodeIndex node, const Point<N, CoordType>& pt);
+
+
+    static size_t nextSplit(size_t split);
+    void build(vector<KDPair>& vec, const KDBuildOptions& options, size_t split = 0);
+    size_t splitRange(vector<KDPair>& vec, size_t first, size_t last, size_t& split);
+    size_t medianSplit(vector<KDPair>& vec, size_t first, size_t last, size_t split);
+    size_t midpointSplit(vector<KDPair>& vec, size_t first, size_t last, size_t split, double mid);
+    NodeIndex createKDTree(vector<KDPair>& vec, vector<NodeIndex>& order,
+                           size_t first, size_t last, size_t split, NodeIndex pre);
+    void createKDTreeParallel(TaskPool& pool, size_t cutoff, vector<KDPair>& vec, vector<NodeIndex>& order,
+                              size_t first, size_t last, size_t split, NodeIndex pre);
+
+    // Index used for a missing child or an empty tree
+    const static NodeIndex NIL;
+
+    // Marks a slot that holds no point, in a bucket or out of the tree
+    const static unsigned char FREE;
+
+    // Largest fraction of erased nodes a subtree keeps before it is rebuilt
+    const static double TOMBSTONE_LIMIT;
+
+    // Largest fraction of a subtree one child may hold before the subtree is
+    // rebuilt, and the fraction of it that must have been inserted since it
+    // was built for that to happen
+    const static double BALANCE_LIMIT;
+    const static double INSERTION_LIMIT;
 
+    size_t sz;        // Current number of elements stored in this KDTree
 
-    KDNode<N, ElemType>* createKDTree(vector<pair<Point<N>, ElemType>> vec, int split);
+    NodeIndex root;       // Index of the root node of this KD-Tree
 
-    const static int LEFT;
-    const static int RIGHT;
-    const static int NODIR;
-    // Dimension of the KD-tree
-    size_t dim;   // The Dimension of this KD-Tree
+    size_t unused;        // Slots of the node arrays no longer in the tree
 
-    size_t sz;        // Current number of elements stored in this KDTree
+    size_t bucketSize;    // Most points a leaf bucket holds
+
+    KDSplitRule splitRule;    // How nodes pick their split
 
-    KDNode<N, ElemType> *root;       // Current root node of this KD-Tree
+    bool keepBoxes;       // Whether lower and upper are kept
 
+    // The node arrays get their memory from Alloc, rebound to each array's type
+    template <typename T>
+    using NodeArray = vector<T, typename allocator_traits<Alloc>::template rebind_alloc<T> >;
+
+    // Node storage, one entry per node in each array
+    NodeArray<Point<N, CoordType> > points;    // The point stored in each node
+    NodeArray<ElemType> elems;      // The value associated with each point
+    NodeArray<uint32_t> splits;     // The dimension each node compares on
+    NodeArray<KDNode> nodes;        // The children of each node
+    NodeArray<uint32_t> subtreeSizes;  // The points in each subtree, erased ones included
+    NodeArray<uint32_t> tombstones;    // The erased points in each subtree
+    NodeArray<uint32_t> insertions;    // The points inserted into each subtree since it was built
+    NodeArray<unsigned char> erased;   // Whether each point was erased, or FREE
+
+    // The corners of the smallest box around the points of each subtree
+    // that were not erased when it was last fitted, while keepBoxes is set.
+    // Erasing a point leaves the boxes as they are, since a box too large
+    // only prunes less. An empty subtree has lower above upper.
+    NodeArray<Point<N, CoordType> > lower;
+    NodeArray<Point<N, CoordType> > upper;
 
 };
 
-template <size_t N, typename ElemType>
-const int KDTree<N, ElemType>::LEFT = 0;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const NodeIndex KDTree<N, ElemType, Alloc, CoordType>::NIL = UINT32_MAX;
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const unsigned char KDTree<N, ElemType, Alloc, CoordType>::FREE = 2;
 
-template <size_t N, typename ElemType>
-const int KDTree<N, ElemType>::RIGHT = 1;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const double KDTree<N, ElemType, Alloc, CoordType>::TOMBSTONE_LIMIT = 0.5;
 
-template <size_t N, typename ElemType>
-const int KDTree<N, ElemType>::NODIR = 2;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const double KDTree<N, ElemType, Alloc, CoordType>::BALANCE_LIMIT = 0.7;
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const double KDTree<N, ElemType, Alloc, CoordType>::INSERTION_LIMIT = 0.25;
 
 
 
 
 /** KDTree class implementation details */
-template <size_t N, typename ElemType>
-KDNode<N, ElemType> * KDTree<N, ElemType>::modify_search(const Point<N>& pt, int& direction) {
-    KDNode<N, ElemType> *cur = root;
-    direction = NODIR;
-    int rd = 0; // Current Dimension to compare
-    while (cur != NULL && cur->position != pt) {
-        if (pt[rd % N] < cur->position[rd % N]) {
-            if (cur->left == NULL) {
-                direction = LEFT;
-                break;
+
+// descend follows the search for pt from the root. It returns the slot holding
+// pt, erased or not, or NIL if there is none. last is left at the node where
+// the search ended: the bucket pt belongs in, or the node missing the child
+// pt would hang under (NIL when the tree is empty).
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::descend(const Point<N, CoordType>& pt, NodeIndex& last) const {
+    last = NIL;
+    NodeIndex cur = root;
+    while (cur != NIL) {
+        last = cur;
+        if (nodes[cur].left == BUCKET) {
+            NodeIndex end = cur + nodes[cur].right;
+            for (NodeIndex i = cur; i < end; ++i) {
+                if (erased[i] != FREE && points[i] == pt) return i;
             }
-            cur = cur->left;
+            return NIL;
+        }
+        if (points[cur] == pt) return cur;
+
+        if (pt[splits[cur]] < points[cur][splits[cur]]) {
+            cur = nodes[cur].left;
         } else {
-            if (cur->right == NULL) {
-                direction = RIGHT;
-                break;
-            }
-            cur = cur->right;
+            cur = nodes[cur].right;
         }
-        rd++;
     }
+    return NIL;
+}
 
-    return cur;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::search(const Point<N, CoordType>& pt) const {
+    return view().find(pt);
+}
+
+// appendSlot appends a slot outside of the tree to the node arrays and
+// returns its index. The value is constructed from args first, so a throwing
+// constructor leaves the tree untouched.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::appendSlot(const Point<N, CoordType>& pt, unsigned char state,
+                                                            Args&&... args) {
+    if (elems.size() >= BUCKET) throw length_error("Too many nodes in KDTREE");
+
+    elems.emplace_back(std::forward<Args>(args)...);
+    try {
+        points.push_back(pt);
+        splits.push_back(0);
+        KDNode node = {NIL, NIL};
+        nodes.push_back(node);
+        subtreeSizes.push_back(0);
+        tombstones.push_back(0);
+        insertions.push_back(0);
+        erased.push_back(state);
+        if (keepBoxes) {
+            // pt may have been in points, and moved with it
+            lower.push_back(points.back());
+            upper.push_back(points.back());
+        }
+    } catch (...) {
+        // Roll every array back to the same length
+        elems.pop_back();
+        points.resize(elems.size());
+        splits.resize(elems.size());
+        nodes.resize(elems.size());
+        subtreeSizes.resize(elems.size());
+        tombstones.resize(elems.size());
+        insertions.resize(elems.size());
+        erased.resize(elems.size());
+        if (keepBoxes) lower.resize(elems.size());
+        throw;
+    }
+    return NodeIndex(elems.size() - 1);
+}
+
+// appendFree appends up to count free slots, which give a bucket room to grow,
+// and returns how many it appended. Values that cannot be default constructed
+// get no spare room, and their buckets grow one slot at a time.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::appendFree(const Point<N, CoordType>& pt, size_t count, true_type) {
+    for (size_t i = 0; i < count; ++i)
+        appendSlot(pt, FREE);
+    return count;
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::appendFree(const Point<N, CoordType>&, size_t, false_type) {
+    return 0;
 }
 
-template <size_t N, typename ElemType>
-KDNode<N, ElemType> *KDTree<N, ElemType>::search(const Point<N>& pt) const {
+// newBucket appends a bucket holding only pt, with room for bucketSize
+// points, and returns its index.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::newBucket(const Point<N, CoordType>& pt, size_t split, Args&&... args) {
+    NodeIndex head = appendSlot(pt, FREE, std::forward<Args>(args)...);
+    size_t spare = appendFree(pt, bucketSize - 1, typename is_default_constructible<ElemType>::type());
+
+    erased[head] = 0;
+    nodes[head].left = BUCKET;
+    nodes[head].right = NodeIndex(1 + spare);
+    splits[head] = split;
+    subtreeSizes[head] = 1;
+    return head;
+}
+
+// splitBucket turns the bucket at head, two or more slots that all hold a
+// point, into a node holding the point splitRange picks among those points
+// and pt. The points below it go to a bucket over the rest of the old slots,
+// and the others to a new bucket at the end of the node arrays with room for
+// bucketSize points; a sliding midpoint may leave more points below than
+// the old slots hold, and then the two sides swap places. It sets slot to
+// where pt went and returns head.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::splitBucket(NodeIndex head, const Point<N, CoordType>& pt,
+                                                             NodeIndex& slot, Args&&... args) {
+    NodeIndex count = nodes[head].right;
+    vector<KDPair> vec;
+    vec.reserve(count + 1);
+    vec.push_back(KDPair(pt, ElemType(std::forward<Args>(args)...)));
+
+    // The new bucket is appended before any value is moved
+    NodeIndex upper = NodeIndex(elems.size());
+    appendFree(pt, bucketSize, typename is_default_constructible<ElemType>::type());
+    for (NodeIndex i = head; i < head + count; ++i)
+        vec.push_back(KDPair(points[i], std::move(elems[i])));
+
+    size_t split = splits[head];
+    size_t pos = splitRange(vec, 0, vec.size(), split);
+    size_t above = vec.size() - pos - 1;
+    bool lowerInPlace = pos < count;
+    NodeIndex lowerAt = lowerInPlace ? head + 1 : upper;
+    NodeIndex upperAt = lowerInPlace ? upper : head + 1;
+    for (size_t i = 0; i < vec.size(); ++i) {
+        NodeIndex target = i < pos ? NodeIndex(lowerAt + i) : i == pos ? head : NodeIndex(upperAt + (i - pos - 1));
+        if (vec[i].first == pt) slot = target;
+        points[target] = vec[i].first;
+        elems[target] = std::move(vec[i].second);
+        erased[target] = 0;
+    }
+    for (NodeIndex i = NodeIndex(head + 1 + (lowerInPlace ? pos : above)); i < head + count; ++i)
+        erased[i] = FREE;
+
+    // Either side may be empty, and then its slots go unused
+    size_t next = nextSplit(split);
+    auto hang = [&] (NodeIndex start, NodeIndex capacity, size_t size) {
+        if (size == 0) {
+            unused += capacity;
+            return NIL;
+        }
+        nodes[start].left = BUCKET;
+        nodes[start].right = capacity;
+        splits[start] = next;
+        subtreeSizes[start] = NodeIndex(size);
+        return start;
+    };
+    NodeIndex inPlace = count - 1, appended = NodeIndex(bucketSize);
+    nodes[head].left = hang(lowerAt, lowerInPlace ? inPlace : appended, pos);
+    nodes[head].right = hang(upperAt, lowerInPlace ? appended : inPlace, above);
+    splits[head] = split;
+    subtreeSizes[head] = count + 1;
+    insertions[head] = 0;
+    return head;
+}
 
-    // We can't modify the object's internal data
-    // When the method is const-qualified
-    // And const objects can only access const member functions
-    KDNode<N, ElemType> *cur = root;
-    int rd = 0; // Current Dimension to compare
-    while (cur != NULL && cur->position != pt) {
-        if (pt[rd % N] < cur->position[rd % N]) {
-            cur = cur->left;
+// addToBucket puts pt into the bucket at head, sets slot to where it went,
+// and returns the node that now stands where the bucket was. A full bucket
+// is first moved to the end of the node arrays with room for bucketSize
+// points; once it holds that many, it is split. With buckets of one point,
+// the point becomes a node instead. Buckets holding erased points, and those
+// whose values cannot be default constructed to give the new bucket room,
+// are rebuilt together with pt, and slot is left NIL. NIL is returned when
+// that rebuilt the whole tree.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::addToBucket(NodeIndex head, const Point<N, CoordType>& pt,
+                                                             NodeIndex& slot, Args&&... args) {
+    NodeIndex count = nodes[head].right;
+    for (slot = head; slot < head + count; ++slot) {
+        if (erased[slot] == FREE) {
+            elems[slot] = ElemType(std::forward<Args>(args)...);
+            points[slot] = pt;
+            erased[slot] = 0;
+            subtreeSizes[head]++;
+            insertions[head]++;
+            return head;
+        }
+    }
+
+    if (count >= bucketSize) {
+        if (count == 1) {
+            // The point of the bucket becomes a node, with pt in a bucket below
+            size_t split = splits[head];
+            NodeIndex child = newBucket(pt, nextSplit(split), std::forward<Args>(args)...);
+            bool below = pt[split] < points[head][split];
+            nodes[head].left = below ? child : NIL;
+            nodes[head].right = below ? NIL : child;
+            subtreeSizes[head]++;
+            insertions[head]++;
+            slot = child;
+            return head;
+        }
+        if (tombstones[head] == 0 && is_default_constructible<ElemType>::value)
+            return splitBucket(head, pt, slot, std::forward<Args>(args)...);
+
+        slot = NIL;
+        KDPair extra(pt, ElemType(std::forward<Args>(args)...));
+        return rebuildSubtree(pt, head, &extra);
+    }
+
+    // Everything that may throw is appended before the old values are moved
+    NodeIndex moved = appendSlot(pt, FREE, std::forward<Args>(args)...);
+    size_t spare = appendFree(pt, bucketSize - count - 1, typename is_default_constructible<ElemType>::type());
+    for (NodeIndex i = head; i < head + count; ++i) {
+        appendSlot(points[i], erased[i], std::move(elems[i]));
+        erased[i] = FREE;
+    }
+
+    slot = moved;
+    erased[moved] = 0;
+    nodes[moved].left = BUCKET;
+    nodes[moved].right = NodeIndex(1 + spare + count);
+    splits[moved] = splits[head];
+    subtreeSizes[moved] = subtreeSizes[head] + 1;
+    tombstones[moved] = tombstones[head];
+    insertions[moved] = insertions[head] + 1;
+
+    KDNode none = {NIL, NIL};
+    nodes[head] = none;
+    subtreeSizes[head] = 0;
+    tombstones[head] = 0;
+    insertions[head] = 0;
+    unused += count;
+
+    walkPath(pt, [&] (NodeIndex* link) {
+        if (*link != head) return true;
+        *link = moved;
+        return false;
+    });
+    return moved;
+}
+
+// findOrCreate returns the slot holding pt. If there is none, it puts pt with
+// a value constructed from args into the bucket the search ended in, or into
+// a new bucket where the search fell off the tree, and sets created.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::findOrCreate(const Point<N, CoordType>& pt, bool& created, Args&&... args) {
+    NodeIndex last;
+    NodeIndex cur = descend(pt, last);
+
+    created = cur == NIL || erased[cur];
+    if (cur != NIL) {
+        if (created) {
+            // The point was erased but is still there, so revive it
+            elems[cur] = ElemType(std::forward<Args>(args)...);
+            erased[cur] = 0;
+            sz++;
+            walkPath(pt, [&] (NodeIndex* link) {
+                tombstones[*link]--;
+                if (keepBoxes) extendBox(*link, pt);
+                return true;
+            });
+        }
+        return cur;
+    }
+
+    NodeIndex top;
+    if (last == NIL) {
+        // NULL TREE
+        top = root = cur = newBucket(pt, 0, std::forward<Args>(args)...);
+    } else if (nodes[last].left != BUCKET) {
+        top = cur = newBucket(pt, nextSplit(splits[last]), std::forward<Args>(args)...);
+        if (pt[splits[last]] < points[last][splits[last]]) {
+            nodes[last].left = top;
         } else {
-            cur = cur->right;
+            nodes[last].right = top;
         }
-        rd++;
+    } else {
+        top = addToBucket(last, pt, cur, std::forward<Args>(args)...);
+        if (top == NIL) return search(pt);
     }
-    return cur;
+    sz++;
+    if (keepBoxes) fitBoxes(top);
+
+    // Count the new point in every subtree above its bucket, and find the
+    // highest of them where one child now holds too much of the subtree.
+    // Only subtrees that grew enough since they were built qualify, as the
+    // median split cannot balance points that share a coordinate.
+    NodeIndex rebuildTop = NIL;
+    size_t depth = 0;
+    walkPath(pt, [&] (NodeIndex* link) {
+        NodeIndex node = *link;
+        if (node == top) return false;
+
+        depth++;
+        subtreeSizes[node]++;
+        insertions[node]++;
+        if (keepBoxes) extendBox(node, pt);
+        NodeIndex child = pt[splits[node]] < points[node][splits[node]] ? nodes[node].left : nodes[node].right;
+        if (rebuildTop == NIL && subtreeSizes[child] > BALANCE_LIMIT * subtreeSizes[node] &&
+                insertions[node] >= INSERTION_LIMIT * subtreeSizes[node])
+            rebuildTop = node;
+        return true;
+    });
+
+    // As long as the bucket is no deeper than in a tree whose every node is
+    // balanced, the tree is left as it is. Rebuilding moves the points around.
+    double balancedDepth = log(double(subtreeSizes[root]) / bucketSize) / -log(BALANCE_LIMIT);
+    if (rebuildTop != NIL && depth > balancedDepth) {
+        rebuildSubtree(pt, rebuildTop);
+        cur = NIL;
+    }
+    if (unused > sz) {
+        rebuildAll();
+        cur = NIL;
+    }
+    return cur != NIL ? cur : search(pt);
 }
 
-template <size_t N, typename ElemType>
-void KDTree<N,ElemType>::Destroy(KDNode<N, ElemType> *node) {
-    if (node == NULL) return;
-    Destroy(node->left);
-    Destroy(node->right);
-    delete node;
+// walkPath follows the search for pt from the root, calling visit with the
+// link to every node on the way (starting with root itself), down to the
+// node or the bucket holding pt. It stops early when visit returns false.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename Visitor>
+void KDTree<N, ElemType, Alloc, CoordType>::walkPath(const Point<N, CoordType>& pt, Visitor visit) {
+    NodeIndex *link = &root;
+    while (*link != NIL) {
+        NodeIndex cur = *link;
+        if (!visit(link) || nodes[cur].left == BUCKET || points[cur] == pt) return;
+
+        if (pt[splits[cur]] < points[cur][splits[cur]]) {
+            link = &nodes[cur].left;
+        } else {
+            link = &nodes[cur].right;
+        }
+    }
 }
 
-template <size_t N, typename ElemType>
-KDNode<N, ElemType>* KDTree<N, ElemType>::Clone(KDNode<N, ElemType>* other) {
-    if (other == NULL) return NULL;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+bool KDTree<N, ElemType, Alloc, CoordType>::erase(const Point<N, CoordType>& pt) {
+    NodeIndex target = search(pt);
+    if (target == NIL) return false;
+
+    erased[target] = 1;
+    sz--;
+
+    // Count the tombstone in every subtree holding it, and find the
+    // highest of them that is now too full of tombstones
+    NodeIndex rebuildTop = NIL;
+    walkPath(pt, [&] (NodeIndex* link) {
+        NodeIndex cur = *link;
+        tombstones[cur]++;
+        if (rebuildTop == NIL && tombstones[cur] > TOMBSTONE_LIMIT * subtreeSizes[cur])
+            rebuildTop = cur;
+        return true;
+    });
+
+    if (rebuildTop != NIL) rebuildSubtree(pt, rebuildTop);
+    if (unused > sz) rebuildAll();
+    return true;
+}
 
-    KDNode<N, ElemType> *node = NULL;
+// rebuildSubtree replaces the subtree at top, which lies on the search path
+// for pt, with a balanced subtree of the points in it that were not erased,
+// and extra if given. It returns the root of the new subtree, or NIL when
+// top was the root and the whole tree was rebuilt. The new subtree reuses
+// the old subtree's slots where it can: a bucket takes the next run of
+// consecutive slots long enough for it, and goes to the end of the node
+// arrays when there is none. The slots left over go unused until the whole
+// tree is rebuilt, which happens once there are more unused slots than points.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::rebuildSubtree(const Point<N, CoordType>& pt, NodeIndex top,
+                                                                KDPair* extra) {
+    if (top == root) {
+        rebuildAll(extra);
+        return NIL;
+    }
 
-    node = new KDNode<N, ElemType>(other->position, other->element, other->split);
+    // Every subtree above this one loses its tombstones
+    uint32_t removed = tombstones[top];
+    NodeIndex parent = NIL;
+    walkPath(pt, [&] (NodeIndex* above) {
+        if (*above == top) return false;
+        parent = *above;
+        subtreeSizes[parent] -= removed;
+        tombstones[parent] -= removed;
+        return true;
+    });
+
+    // Gather the slots of the subtree and the points still in it
+    vector<NodeIndex> slots;
+    vector<KDPair> vec;
+    vector<NodeIndex> pending(1, top);
+    while (!pending.empty()) {
+        NodeIndex cur = pending.back();
+        pending.pop_back();
+        if (nodes[cur].left == BUCKET) {
+            for (NodeIndex i = cur; i < cur + nodes[cur].right; ++i) {
+                slots.push_back(i);
+                if (!erased[i]) vec.push_back(KDPair(points[i], std::move(elems[i])));
+            }
+            continue;
+        }
+        slots.push_back(cur);
+        if (!erased[cur]) vec.push_back(KDPair(points[cur], std::move(elems[cur])));
+        if (nodes[cur].left != NIL) pending.push_back(nodes[cur].left);
+        if (nodes[cur].right != NIL) pending.push_back(nodes[cur].right);
+    }
+    if (extra != NULL) vec.push_back(std::move(*extra));
+
+    // Build the subtree aside, starting from the split of the old root
+    KDTree subtree(get_allocator());
+    subtree.bucketSize = bucketSize;
+    subtree.splitRule = splitRule;
+    subtree.build(vec, KDBuildOptions(), splits[top]);
+
+    // Pick a slot for every node of it, in preorder
+    sort(slots.begin(), slots.end());
+    vector<NodeIndex> place(vec.size());
+    vector<NodeIndex> spare;
+    size_t next = 0;
+    NodeIndex end = NodeIndex(elems.size());
+    for (size_t i = 0; i < vec.size(); ) {
+        if (subtree.nodes[i].left == BUCKET) {
+            size_t count = subtree.nodes[i].right;
+            while (next + count <= slots.size() && slots[next + count - 1] - slots[next] != count - 1)
+                spare.push_back(slots[next++]);
+            NodeIndex first = end;
+            if (next + count <= slots.size()) {
+                first = slots[next];
+                next += count;
+            } else {
+                end += NodeIndex(count);
+            }
+            for (size_t j = 0; j < count; ++j)
+                place[i++] = NodeIndex(first + j);
+        } else if (!spare.empty()) {
+            place[i++] = spare.back();
+            spare.pop_back();
+        } else if (next < slots.size()) {
+            place[i++] = slots[next++];
+        } else {
+            place[i++] = end++;
+        }
+    }
 
-    node->left = Clone(other->left);
-    node->right = Clone(other->right);
-    return node;
+    // Move the nodes over. Slots past the end are appended in the order
+    // they were picked.
+    for (size_t i = 0; i < vec.size(); ++i) {
+        NodeIndex slot = place[i];
+        if (slot == elems.size()) {
+            appendSlot(subtree.points[i], 0, std::move(subtree.elems[i]));
+        } else {
+            points[slot] = subtree.points[i];
+            elems[slot] = std::move(subtree.elems[i]);
+            erased[slot] = 0;
+        }
+        KDNode node = subtree.nodes[i];
+        if (node.left != BUCKET) {
+            node.left = node.left == NIL ? NIL : place[node.left];
+            node.right = node.right == NIL ? NIL : place[node.right];
+        }
+        nodes[slot] = node;
+        splits[slot] = subtree.splits[i];
+        subtreeSizes[slot] = subtree.subtreeSizes[i];
+        tombstones[slot] = 0;
+        insertions[slot] = 0;
+    }
+
+    // Free whatever the new subtree left over
+    spare.insert(spare.end(), slots.begin() + next, slots.end());
+    KDNode none = {NIL, NIL};
+    for (size_t i = 0; i < spare.size(); ++i) {
+        erased[spare[i]] = FREE;
+        nodes[spare[i]] = none;
+        subtreeSizes[spare[i]] = 0;
+        tombstones[spare[i]] = 0;
+        insertions[spare[i]] = 0;
+    }
+    unused += spare.size();
+
+    NodeIndex newTop = vec.empty() ? NIL : place[0];
+    if (nodes[parent].left == top) {
+        nodes[parent].left = newTop;
+    } else {
+        nodes[parent].right = newTop;
+    }
+    if (keepBoxes && newTop != NIL) fitBoxes(newTop);
+    return newTop;
 }
 
+// fitBox sets the bounding box of node to the smallest one around its own
+// points that were not erased and the boxes of its children.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::fitBox(NodeIndex node) {
+    Point<N, CoordType>& lo = lower[node];
+    Point<N, CoordType>& hi = upper[node];
+    fill(lo.begin(), lo.end(), numeric_limits<CoordType>::max());
+    fill(hi.begin(), hi.end(), numeric_limits<CoordType>::lowest());
+
+    NodeIndex end = nodes[node].left == BUCKET ? node + nodes[node].right : node + 1;
+    for (NodeIndex i = node; i < end; ++i) {
+        if (!erased[i]) extendBox(node, points[i]);
+    }
+    if (nodes[node].left == BUCKET) return;
+
+    NodeIndex children[] = {nodes[node].left, nodes[node].right};
+    for (size_t c = 0; c < 2; ++c) {
+        if (children[c] == NIL) continue;
+        for (size_t d = 0; d < N; ++d) {
+            lo[d] = min(lo[d], lower[children[c]][d]);
+            hi[d] = max(hi[d], upper[children[c]][d]);
+        }
+    }
+}
+
+// fitBoxes fits the box of every node in the subtree at top, children first.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::fitBoxes(NodeIndex top) {
+    if (nodes[top].left != BUCKET) {
+        if (nodes[top].left != NIL) fitBoxes(nodes[top].left);
+        if (nodes[top].right != NIL) fitBoxes(nodes[top].right);
+    }
+    fitBox(top);
+}
+
+// extendBox grows the bounding box of node just enough to hold pt.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::extendBox(NodeIndex node, const Point<N, CoordType>& pt) {
+    for (size_t d = 0; d < N; ++d) {
+        lower[node][d] = min(lower[node][d], pt[d]);
+        upper[node][d] = max(upper[node][d], pt[d]);
+    }
+}
+
+// rebuildAll rebuilds the whole tree from the points that were not erased,
+// and extra if given. The node arrays keep their capacity.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::rebuildAll(KDPair* extra) {
+    vector<KDPair> vec;
+    vec.reserve(sz + 1);
+    for (size_t i = 0; i < elems.size(); ++i) {
+        // Free slots are not points either
+        if (!erased[i])
+            vec.push_back(KDPair(points[i], std::move(elems[i])));
+    }
+    if (extra != NULL) vec.push_back(std::move(*extra));
+
+    // build fills the other arrays from scratch
+    points.clear();
+    elems.clear();
+    root = NIL;
+    unused = 0;
+    build(vec, KDBuildOptions());
+}
 
 
-template <size_t N, typename ElemType>
-KDTree<N, ElemType>::~KDTree() {
-    Destroy(root);
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::~KDTree() {
+    // The node arrays release all nodes at once
     sz = 0;
 }
 
-template <size_t N, typename ElemType>
-KDTree<N, ElemType>::KDTree(const KDTree& rhs) {
-    // Destroy previous KD-Tree first
-    root = NULL;
-    this->operator =(rhs);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(const KDTree& rhs) : sz(rhs.sz), root(rhs.root), unused(rhs.unused),
+                   bucketSize(rhs.bucketSize), splitRule(rhs.splitRule), keepBoxes(rhs.keepBoxes),
+                   points(rhs.points), elems(rhs.elems), splits(rhs.splits), nodes(rhs.nodes),
+                   subtreeSizes(rhs.subtreeSizes), tombstones(rhs.tombstones), insertions(rhs.insertions),
+                   erased(rhs.erased), lower(rhs.lower), upper(rhs.upper) {
+    // Node indices are positions in the arrays, so copying
+    // the arrays copies the links as well
 }
 
-template <size_t N, typename ElemType>
-KDTree<N, ElemType>& KDTree<N, ElemType>::operator=(const KDTree& rhs) {
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(const KDTree& rhs, const Alloc& alloc) : sz(rhs.sz), root(rhs.root),
+                   unused(rhs.unused), bucketSize(rhs.bucketSize), splitRule(rhs.splitRule),
+                   keepBoxes(rhs.keepBoxes),
+                   points(rhs.points, typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)),
+                   elems(rhs.elems, typename NodeArray<ElemType>::allocator_type(alloc)),
+                   splits(rhs.splits, typename NodeArray<uint32_t>::allocator_type(alloc)),
+                   nodes(rhs.nodes, typename NodeArray<KDNode>::allocator_type(alloc)),
+                   subtreeSizes(rhs.subtreeSizes, typename NodeArray<uint32_t>::allocator_type(alloc)),
+                   tombstones(rhs.tombstones, typename NodeArray<uint32_t>::allocator_type(alloc)),
+                   insertions(rhs.insertions, typename NodeArray<uint32_t>::allocator_type(alloc)),
+                   erased(rhs.erased, typename NodeArray<unsigned char>::allocator_type(alloc)),
+                   lower(rhs.lower, typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)),
+                   upper(rhs.upper, typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)) {
+}
 
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(KDTree&& rhs) noexcept : sz(rhs.sz), root(rhs.root),
+                   unused(rhs.unused), bucketSize(rhs.bucketSize), splitRule(rhs.splitRule),
+                   keepBoxes(rhs.keepBoxes),
+                   points(std::move(rhs.points)), elems(std::move(rhs.elems)),
+                   splits(std::move(rhs.splits)), nodes(std::move(rhs.nodes)),
+                   subtreeSizes(std::move(rhs.subtreeSizes)), tombstones(std::move(rhs.tombstones)),
+                   insertions(std::move(rhs.insertions)), erased(std::move(rhs.erased)),
+                   lower(std::move(rhs.lower)), upper(std::move(rhs.upper)) {
+    // The arrays were stolen, so rhs is left with no nodes
+    rhs.sz = 0;
+    rhs.root = NIL;
+    rhs.unused = 0;
+}
 
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>& KDTree<N, ElemType, Alloc, CoordType>::operator=(KDTree&& rhs) {
     if (this != &rhs) {
-        KDNode<N, ElemType> *copy = NULL;
-        try {
-            copy = Clone(rhs.root);
-            Destroy(root);
-            sz = rhs.sz;
-            dim = rhs.dim;
-            root = copy;
-        } catch (...) {
-
-            // Error occurred during construction of copy
-            // Clean the copy data
-            // And re-throw the caught exception
-            Destroy(copy);
-            throw;
-        }
+        // The arrays steal rhs's storage unless the two allocators
+        // differ, in which case the nodes are moved one by one
+        points = std::move(rhs.points);
+        elems = std::move(rhs.elems);
+        splits = std::move(rhs.splits);
+        nodes = std::move(rhs.nodes);
+        subtreeSizes = std::move(rhs.subtreeSizes);
+        tombstones = std::move(rhs.tombstones);
+        insertions = std::move(rhs.insertions);
+        erased = std::move(rhs.erased);
+        lower = std::move(rhs.lower);
+        upper = std::move(rhs.upper);
+        sz = rhs.sz;
+        root = rhs.root;
+        unused = rhs.unused;
+        bucketSize = rhs.bucketSize;
+        splitRule = rhs.splitRule;
+        keepBoxes = rhs.keepBoxes;
+
+        rhs.points.clear();
+        rhs.elems.clear();
+        rhs.splits.clear();
+        rhs.nodes.clear();
+        rhs.subtreeSizes.clear();
+        rhs.tombstones.clear();
+        rhs.insertions.clear();
+        rhs.erased.clear();
+        rhs.lower.clear();
+        rhs.upper.clear();
+        rhs.sz = 0;
+        rhs.root = NIL;
+        rhs.unused = 0;
+    }
+    return *this;
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>& KDTree<N, ElemType, Alloc, CoordType>::operator=(const KDTree& rhs) {
+
+
+    if (this != &rhs) {
+        // Build the copy aside first, so if copying throws
+        // this tree is left unchanged. It uses this tree's
+        // allocator, so its arrays can be swapped in.
+        KDTree copy(rhs, get_allocator());
+        points.swap(copy.points);
+        elems.swap(copy.elems);
+        splits.swap(copy.splits);
+        nodes.swap(copy.nodes);
+        subtreeSizes.swap(copy.subtreeSizes);
+        tombstones.swap(copy.tombstones);
+        insertions.swap(copy.insertions);
+        erased.swap(copy.erased);
+        lower.swap(copy.lower);
+        upper.swap(copy.upper);
+        sz = rhs.sz;
+        root = rhs.root;
+        unused = rhs.unused;
+        bucketSize = rhs.bucketSize;
+        splitRule = rhs.splitRule;
+        keepBoxes = rhs.keepBoxes;
     }
 
 
     return *this;
 }
 
-template <size_t N, typename ElemType>
-KDTree<N, ElemType>::KDTree() {
-    root = NULL;
-    dim = N;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree() {
+    root = NIL;
+    sz = 0;
+    unused = 0;
+    bucketSize = KDBuildOptions::DEFAULT_BUCKET_SIZE;
+    splitRule = KD_SPLIT_CYCLE;
+    keepBoxes = false;
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(const Alloc& alloc) :
+        points(typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)),
+        elems(typename NodeArray<ElemType>::allocator_type(alloc)),
+        splits(typename NodeArray<uint32_t>::allocator_type(alloc)),
+        nodes(typename NodeArray<KDNode>::allocator_type(alloc)),
+        subtreeSizes(typename NodeArray<uint32_t>::allocator_type(alloc)),
+        tombstones(typename NodeArray<uint32_t>::allocator_type(alloc)),
+        insertions(typename NodeArray<uint32_t>::allocator_type(alloc)),
+        erased(typename NodeArray<unsigned char>::allocator_type(alloc)),
+        lower(typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)),
+        upper(typename NodeArray<Point<N, CoordType> >::allocator_type(alloc)) {
+    root = NIL;
     sz = 0;
+    unused = 0;
+    bucketSize = KDBuildOptions::DEFAULT_BUCKET_SIZE;
+    splitRule = KD_SPLIT_CYCLE;
+    keepBoxes = false;
 }
 
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(const KDBuildOptions& options, const Alloc& alloc) : KDTree(alloc) {
+    bucketSize = max<size_t>(options.bucketSize, 1);
+    splitRule = options.splitRule;
+    keepBoxes = options.boundingBoxes;
+}
 
-template <size_t N, typename ElemType>
-size_t KDTree<N, ElemType>::dimension() const {
-    return dim;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+Alloc KDTree<N, ElemType, Alloc, CoordType>::get_allocator() const {
+    return Alloc(elems.get_allocator());
 }
 
-template <size_t N, typename ElemType>
-void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
-    int direction;
-    KDNode<N, ElemType> *cur = modify_search(pt, direction);
 
-    if (cur != NULL && direction == NODIR) {
-        // Override the element
-        cur->element = value;
-    } else if (cur == NULL) {
-        // NULL TREE
-        sz++;
-        root = new KDNode<N, ElemType>(pt, value);
-    } else if (cur != NULL && direction == LEFT) {
-        sz++;
-        cur->left = new KDNode<N, ElemType>(pt,value, (cur->split + 1) % dim);
-    } else {
-        sz++;
-        cur->right = new KDNode<N, ElemType>(pt, value, (cur->split + 1) % dim);
-    }
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::dimension() const {
+    return N;
 }
 
-template <size_t N, typename ElemType>
-size_t KDTree<N, ElemType>::size() const {
-    return sz;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::insert(const Point<N, CoordType>& pt, const ElemType& value) {
+    bool created;
+    NodeIndex cur = findOrCreate(pt, created, value);
+
+    // Override the element
+    if (!created) elems[cur] = value;
 }
 
-template <size_t N, typename ElemType>
-bool KDTree<N, ElemType>::empty() const {
-    return sz == 0;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::insert(const Point<N, CoordType>& pt, ElemType&& value) {
+    bool created;
+    NodeIndex cur = findOrCreate(pt, created, std::move(value));
+
+    // value is only moved from when a node is created
+    if (!created) elems[cur] = std::move(value);
 }
 
-template <size_t N, typename ElemType>
-bool KDTree<N, ElemType>::contains(const Point<N>& pt) const {
-    KDNode<N, ElemType> *cur = search(pt);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename... Args>
+ElemType& KDTree<N, ElemType, Alloc, CoordType>::emplace(const Point<N, CoordType>& pt, Args&&... args) {
+    bool created;
+    NodeIndex cur = findOrCreate(pt, created, std::forward<Args>(args)...);
 
-    if (cur == NULL) return false;
-    return true;
+    if (!created) elems[cur] = ElemType(std::forward<Args>(args)...);
+    return elems[cur];
 }
 
-template <size_t N, typename ElemType>
-ElemType& KDTree<N, ElemType>::operator[](const Point<N>& pt) {
-    int direction;
-    KDNode<N, ElemType> *cur = modify_search(pt, direction);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::size() const {
+    return sz;
+}
 
-    // If the position is not in the KD-Tree
-    // Insert one with default parameter and return it
-    if (cur == NULL) {
-        sz++;
-        cur = root = new KDNode<N, ElemType>(pt);
-    } else if (cur != NULL && direction == NODIR) {
-        // Find
-    } else if (cur != NULL && direction == LEFT) {
-        cur->left = new KDNode<N, ElemType>(pt, ElemType(), (cur->split + 1) % dim);
-        sz++;
-        cur = cur->left;
-    } else {
-        cur->right = new KDNode<N, ElemType>(pt, ElemType(), (cur->split + 1) % dim);
-        cur = cur->right;
-        sz++;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+bool KDTree<N, ElemType, Alloc, CoordType>::empty() const {
+    return sz == 0;
+}
+
+// height walks the whole tree, keeping the nodes still to visit and their
+// depths on a stack of its own.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::height() const {
+    size_t result = 0;
+    vector<pair<NodeIndex, size_t> > pending;
+    if (root != NIL) pending.push_back(make_pair(root, size_t(1)));
+    while (!pending.empty()) {
+        NodeIndex cur = pending.back().first;
+        size_t depth = pending.back().second;
+        pending.pop_back();
+        result = max(result, depth);
+        if (nodes[cur].left == BUCKET) continue;
+        if (nodes[cur].left != NIL) pending.push_back(make_pair(nodes[cur].left, depth + 1));
+        if (nodes[cur].right != NIL) pending.push_back(make_pair(nodes[cur].right, depth + 1));
     }
+    return result;
+}
 
-    return cur->element;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::reserve(size_t count) {
+    if (count > NIL) throw length_error("Too many nodes in KDTREE");
+    points.reserve(count);
+    elems.reserve(count);
+    splits.reserve(count);
+    nodes.reserve(count);
+    subtreeSizes.reserve(count);
+    tombstones.reserve(count);
+    insertions.reserve(count);
+    erased.reserve(count);
+    if (keepBoxes) {
+        lower.reserve(count);
+        upper.reserve(count);
+    }
 }
 
-template <size_t N, typename ElemType>
-ElemType& KDTree<N, ElemType>::at(const Point<N>& pt) {
-    int direction;
-    KDNode<N, ElemType> *cur = modify_search(pt, direction);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+bool KDTree<N, ElemType, Alloc, CoordType>::contains(const Point<N, CoordType>& pt) const {
+    NodeIndex cur = search(pt);
 
-    if (cur == NULL || direction != NODIR) throw out_of_range("No Point in KDTREE");
-    else return cur->element;
+    if (cur == NIL) return false;
+    return true;
 }
 
-template <size_t N, typename ElemType>
-const ElemType& KDTree<N, ElemType>::at(const Point<N>& pt) const {
-    return const_cast<KDTree<N, ElemType>* >(this)->at(pt);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+ElemType& KDTree<N, ElemType, Alloc, CoordType>::operator[](const Point<N, CoordType>& pt) {
+    // If the position is not in the KD-Tree
+    // Insert one with default parameter and return it
+    bool created;
+    return elems[findOrCreate(pt, created)];
 }
 
-template <size_t N, typename ElemType>
-KDNode<N, ElemType>* KDTree<N, ElemType>::createKDTree(vector<pair<Point<N>, ElemType>> vec, int split) {
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+ElemType& KDTree<N, ElemType, Alloc, CoordType>::at(const Point<N, CoordType>& pt) {
+    NodeIndex cur = search(pt);
 
+    if (cur == NIL) throw out_of_range("No Point in KDTREE");
+    else return elems[cur];
+}
 
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+const ElemType& KDTree<N, ElemType, Alloc, CoordType>::at(const Point<N, CoordType>& pt) const {
+    return const_cast<KDTree<N, ElemType, Alloc, CoordType>* >(this)->at(pt);
+}
 
+// nextSplit returns the dimension after split, taking the dimensions in
+// turn. N is known at compile time, so this is a compare and no division.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+inline size_t KDTree<N, ElemType, Alloc, CoordType>::nextSplit(size_t split) {
+    return split + 1 == N ? 0 : split + 1;
+}
 
-    KDIter first = vec.begin();
-    KDIter last = vec.end();
+// splitRange partitions vec[first, last) for a node and returns the position
+// of the point the node will hold. Cycling through the dimensions, the node
+// splits on split at the median. Under the other rules it splits on the
+// dimension the points spread the most along, or vary the most along, and
+// split is set to it.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::splitRange(vector<KDPair>& vec, size_t first, size_t last, size_t& split) {
+    if (splitRule == KD_SPLIT_CYCLE) return medianSplit(vec, first, last, split);
+
+    // The bounding box of the points, and their variances times their count
+    double lo[N], hi[N], mean[N], scatter[N];
+    for (size_t d = 0; d < N; ++d) {
+        lo[d] = hi[d] = double(vec[first].first[d]);
+        mean[d] = scatter[d] = 0;
+    }
+    for (size_t i = first; i < last; ++i) {
+        double seen = double(i - first + 1);
+        for (size_t d = 0; d < N; ++d) {
+            double coord = double(vec[i].first[d]);
+            lo[d] = min(lo[d], coord);
+            hi[d] = max(hi[d], coord);
+            double delta = coord - mean[d];
+            mean[d] += delta / seen;
+            scatter[d] += delta * (coord - mean[d]);
+        }
+    }
 
-    if (first >= last) return NULL;
-    if (first == last - 1) {
-        sz++;
-        return new KDNode<N, ElemType>(first->first, first->second, split);
+    split = 0;
+    for (size_t d = 1; d < N; ++d) {
+        if (splitRule == KD_SPLIT_MAX_VARIANCE ? scatter[d] > scatter[split] : hi[d] - lo[d] > hi[split] - lo[split])
+            split = d;
     }
 
-    // Sort this vector according to current split
-    // Use the split elem of Point<N> to sort this part of data.
-    // Use lambda Expression from C++11
-    sort(first, last, [=] (const KDPair &pva, const KDPair &pvb) {return pva.first[split] < pvb.first[split];});
+    if (splitRule == KD_SPLIT_SLIDING_MIDPOINT)
+        return midpointSplit(vec, first, last, split, lo[split] + (hi[split] - lo[split]) / 2);
+    return medianSplit(vec, first, last, split);
+}
+
+// midpointSplit partitions vec[first, last) into the keys below mid along
+// split and the rest, and returns the position of the smallest of the rest,
+// which it moves to the front of them. The cut thus slides from mid to the
+// nearest point above it, so both cells around it are nonempty whenever the
+// keys are not all equal. Keys too large to take the middle of fall back to
+// the median.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::midpointSplit(vector<KDPair>& vec, size_t first, size_t last,
+                                                            size_t split, double mid) {
+    KDIter lo = vec.begin() + first;
+    KDIter hi = vec.begin() + last;
+    KDIter cut = partition(lo, hi, [=] (const KDPair &pv) {return double(pv.first[split]) < mid;});
+    if (cut == hi) return medianSplit(vec, first, last, split);
+
+    KDIter least = min_element(cut, hi, [=] (const KDPair &pva, const KDPair &pvb) {return pva.first[split] < pvb.first[split];});
+    swap(*cut, *least);
+    return cut - vec.begin();
+}
+
+// medianSplit partitions vec[first, last) around its median along split and
+// returns the median's position. Everything before it compares < and
+// everything after it compares >=: keys equal to the median are moved to the
+// front of the right half, and the first of them becomes the median.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::medianSplit(vector<KDPair>& vec, size_t first, size_t last, size_t split) {
+    KDIter lo = vec.begin() + first;
+    KDIter hi = vec.begin() + last;
+    KDIter mid = lo + (hi - lo) / 2;
 
-    // Recursively Construct subtrees(sort by certain dimension)
-    KDIter mid = first + (last - first) / 2;
+    // Select the median along the current split
+    nth_element(lo, mid, hi, [=] (const KDPair &pva, const KDPair &pvb) {return pva.first[split] < pvb.first[split];});
 
     // Left Subtree : <
     // Right Subtree : >=
-    // Need to find the first elem with split dim > previous one
-    while (true) {
-        KDIter left = mid - 1;
-        if (left < first || mid->first[split] != left->first[split])
+    // Everything before mid is <= the median
+    CoordType key = mid->first[split];
+    KDIter firstEqual = partition(lo, mid, [=] (const KDPair &pv) {return pv.first[split] < key;});
+    if (firstEqual != mid) {
+        swap(*firstEqual, *mid);
+        mid = firstEqual;
+    }
+    return mid - vec.begin();
+}
+
+// createKDTree builds the subtree for vec[first, last) in place. The point
+// splitRange picks stays at its position in vec, and the two parts around it
+// are built in turn, down to ranges small enough for a bucket. Nodes are numbered
+// in preorder starting from pre, the points of a bucket included: a left
+// child always follows its parent in the node arrays, and every subtree
+// occupies a contiguous range of them. order[i] records which position of
+// vec becomes node i. Only the smaller half is built recursively and the
+// larger one is handled by the loop, which bounds the recursion depth by
+// log(n) even when many keys are equal.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+NodeIndex KDTree<N, ElemType, Alloc, CoordType>::createKDTree(vector<KDPair>& vec, vector<NodeIndex>& order,
+                                                       size_t first, size_t last, size_t split, NodeIndex pre) {
+    NodeIndex subroot = NIL;
+    NodeIndex *link = &subroot; // Where to hang the next node
+
+    while (first < last) {
+        if (last - first <= bucketSize) {
+            // The rest of the range makes a bucket, in consecutive nodes
+            for (size_t i = first; i < last; ++i)
+                order[pre + (i - first)] = NodeIndex(i);
+            nodes[pre].left = BUCKET;
+            nodes[pre].right = NodeIndex(last - first);
+            splits[pre] = split;
+            *link = pre;
             break;
-        else
-            mid = left;
+        }
+
+        size_t pos = splitRange(vec, first, last, split);
+        NodeIndex cur = pre;
+        NodeIndex rightPre = NodeIndex(pre + 1 + (pos - first));
+        order[cur] = NodeIndex(pos);
+        splits[cur] = split;
+        *link = cur;
+
+        size_t next = nextSplit(split);
+        if (pos - first < last - pos - 1) {
+            nodes[cur].left = createKDTree(vec, order, first, pos, next, pre + 1);
+            link = &nodes[cur].right;
+            first = pos + 1;
+            pre = rightPre;
+        } else {
+            nodes[cur].right = createKDTree(vec, order, pos + 1, last, next, rightPre);
+            link = &nodes[cur].left;
+            last = pos;
+            pre = pre + 1;
+        }
+        split = next;
     }
 
-    KDNode<N, ElemType>* cur = new KDNode<N, ElemType>(mid->first, mid->second, split);
-    sz++;
-    if (first <= mid)
-        cur->left = createKDTree(vector<KDPair>(first, mid), (split + 1) % dim);
+    return subroot;
+}
 
-    if (mid < last)
-        cur->right = createKDTree(vector<KDPair>(mid + 1, last), (split + 1) % dim);
-    return cur;
+// createKDTreeParallel builds the same subtree as createKDTree, but hands
+// the left half of every range larger than cutoff to the pool. The node
+// numbering does not depend on the order in which halves are built (the
+// left half of a node always starts at pre + 1 and the right half right
+// after it), and the halves write to disjoint parts of vec and of the node
+// arrays, so the result is identical to the serial build.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::createKDTreeParallel(TaskPool& pool, size_t cutoff, vector<KDPair>& vec,
+                                                          vector<NodeIndex>& order, size_t first, size_t last,
+                                                          size_t split, NodeIndex pre) {
+    if (last - first <= max(cutoff, bucketSize)) {
+        createKDTree(vec, order, first, last, split, pre);
+        return;
+    }
+
+    size_t pos = splitRange(vec, first, last, split);
+    NodeIndex cur = pre;
+    NodeIndex rightPre = NodeIndex(pre + 1 + (pos - first));
+    order[cur] = NodeIndex(pos);
+    splits[cur] = split;
+
+    // In preorder the root of a nonempty subtree is its first node
+    size_t next = nextSplit(split);
+    if (first < pos) nodes[cur].left = pre + 1;
+    if (pos + 1 < last) nodes[cur].right = rightPre;
+
+    // The task refers to this frame, so it must finish even if the right
+    // half throws
+    TaskGroup group;
+    TaskGroupWaiter waiter(pool, group);
+    pool.spawn(group, [&] {
+        createKDTreeParallel(pool, cutoff, vec, order, first, pos, next, pre + 1);
+    });
+    createKDTreeParallel(pool, cutoff, vec, order, pos + 1, last, next, rightPre);
+    waiter.wait();
 }
 
+// build turns the pairs in vec into the nodes of this (empty) tree,
+// splitting the work over options.threads threads. The root compares on
+// dimension split.
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+void KDTree<N, ElemType, Alloc, CoordType>::build(vector<KDPair>& vec, const KDBuildOptions& options, size_t split) {
+    if (vec.size() >= BUCKET) throw length_error("Too many nodes in KDTREE");
+
+    KDNode leaf = {NIL, NIL};
+    nodes.assign(vec.size(), leaf);
+    splits.assign(vec.size(), 0);
+    vector<NodeIndex> order(vec.size());
+
+    if (options.threads == 1 || vec.size() <= options.serialCutoff) {
+        root = createKDTree(vec, order, 0, vec.size(), split, 0);
+    } else {
+        TaskPool pool(options.threads);
+        createKDTreeParallel(pool, max<size_t>(options.serialCutoff, 1), vec, order, 0, vec.size(), split, 0);
+        root = vec.empty() ? NIL : 0;
+    }
+
+    // Lay the data out in node order
+    points.reserve(vec.size());
+    elems.reserve(vec.size());
+    for (size_t i = 0; i < vec.size(); ++i) {
+        points.push_back(vec[order[i]].first);
+        elems.push_back(std::move(vec[order[i]].second));
+    }
 
-template <size_t N, typename ElemType>
+    // Children come after their parents in preorder, so the
+    // sizes and boxes of the subtrees can be summed up from
+    // the back. Every node but a bucket has a child, which
+    // tells the nodes apart from the slots of a bucket after
+    // its first.
+    subtreeSizes.assign(vec.size(), 0);
+    tombstones.assign(vec.size(), 0);
+    insertions.assign(vec.size(), 0);
+    erased.assign(vec.size(), 0);
+    if (keepBoxes) {
+        lower.assign(points.begin(), points.end());
+        upper.assign(points.begin(), points.end());
+    }
+    for (size_t i = vec.size(); i-- > 0; ) {
+        const KDNode& node = nodes[i];
+        if (node.left == BUCKET) {
+            subtreeSizes[i] = node.right;
+        } else if (node.left != NIL || node.right != NIL) {
+            subtreeSizes[i] = 1;
+            if (node.left != NIL) subtreeSizes[i] += subtreeSizes[node.left];
+            if (node.right != NIL) subtreeSizes[i] += subtreeSizes[node.right];
+        } else {
+            continue;
+        }
+        if (keepBoxes) fitBox(NodeIndex(i));
+    }
+    sz = vec.size();
+}
+
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
 template <typename InputIterator>
-KDTree<N, ElemType>::KDTree(InputIterator first, InputIterator last) {
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(InputIterator first, InputIterator last) {
 
-    root = NULL;
-    dim = N;
+    root = NIL;
     sz = 0;
+    unused = 0;
+    bucketSize = KDBuildOptions::DEFAULT_BUCKET_SIZE;
+    splitRule = KD_SPLIT_CYCLE;
+    keepBoxes = false;
+
+    // The one buffer that gets partitioned during the build
+    vector<KDPair> vec(first, last);
+    build(vec, KDBuildOptions());
+}
 
-    vector<pair<Point<N>, ElemType> > vec(first, last);
-    root = createKDTree(vec, 0);
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename InputIterator>
+KDTree<N, ElemType, Alloc, CoordType>::KDTree(InputIterator first, InputIterator last, const KDBuildOptions& options) {
+
+    root = NIL;
+    sz = 0;
+    unused = 0;
+    bucketSize = max<size_t>(options.bucketSize, 1);
+    splitRule = options.splitRule;
+    keepBoxes = options.boundingBoxes;
+
+    vector<KDPair> vec(first, last);
+    build(vec, options);
 }
 
 
 
-template <size_t N, typename ElemType>
-ElemType KDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+typename KDTree<N, ElemType, Alloc, CoordType>::View KDTree<N, ElemType, Alloc, CoordType>::view() const {
+    View v = {points.data(), elems.data(), splits.data(), nodes.data(), erased.data(), root, sz,
+              keepBoxes ? lower.data() : NULL, keepBoxes ? upper.data() : NULL};
+    return v;
+}
 
-    // Recording of the search path
-    stack<KDNode<N, ElemType>* > search_path;
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+ElemType KDTree<N, ElemType, Alloc, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                                  const KDSearchOptions& options) const {
+    return view().kNNValue(key, k, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                                const KDSearchOptions& options) const {
+    return view().kNearest(key, k, neighbors, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+ElemType KDTree<N, ElemType, Alloc, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                                  KNNQueryContext& context, const KDSearchOptions& options) const {
+    return view().kNNValue(key, k, context, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                                KNNQueryContext& context, const KDSearchOptions& options) const {
+    return view().kNearest(key, k, neighbors, context, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+vector<ElemType> KDTree<N, ElemType, Alloc, CoordType>::kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads,
+                                                               const KDSearchOptions& options) const {
+    return view().kNNValueBatch(keys, k, threads, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                                                     vector<Neighbor>& neighbors, size_t threads,
+                                                     const KDSearchOptions& options) const {
+    return view().kNearestBatch(keys, k, neighbors, threads, options);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTree<N, ElemType, Alloc, CoordType>::rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const {
+    return view().rangeQuery(lo, hi, out);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+size_t KDTree<N, ElemType, Alloc, CoordType>::rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const {
+    return view().rangeCount(lo, hi);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTree<N, ElemType, Alloc, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const {
+    return view().radiusSearch(key, radius, out);
+}
+
+template <size_t N, typename ElemType, typename Alloc, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTree<N, ElemType, Alloc, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                                            size_t maxResults) const {
+    return view().radiusSearch(key, radius, out, maxResults);
+}
+
+
+
+/** KDTreeView class implementation details */
+template <size_t N, typename ElemType, typename CoordType>
+const NodeIndex KDTreeView<N, ElemType, CoordType>::NIL = UINT32_MAX;
+
+template <size_t N, typename ElemType, typename CoordType>
+NodeIndex KDTreeView<N, ElemType, CoordType>::find(const Point<N, CoordType>& pt) const {
+    NodeIndex cur = root;
+    while (cur != NIL && nodes[cur].left != BUCKET && points[cur] != pt) {
+        if (pt[splits[cur]] < points[cur][splits[cur]]) {
+            cur = nodes[cur].left;
+        } else {
+            cur = nodes[cur].right;
+        }
+    }
+
+    if (cur != NIL && nodes[cur].left == BUCKET) {
+        NodeIndex end = cur + nodes[cur].right;
+        for (; cur < end; ++cur) {
+            if (!erased[cur] && points[cur] == pt) return cur;
+        }
+        return NIL;
+    }
+
+    // An erased node only keeps its place in the tree
+    if (cur != NIL && erased[cur]) return NIL;
+    return cur;
+}
 
-    double min_dist =  LONG_MAX;
-    Point<N> nearest;
+// scanBucket offers every point of the bucket at head within the bound to
+// bqueue, and returns false once the search has examined as many points as
+// it may. The points of a bucket are consecutive, so the scan streams
+// through them.
+template <size_t N, typename ElemType, typename CoordType>
+bool KDTreeView<N, ElemType, CoordType>::scanBucket(NodeIndex head, const Point<N, CoordType>& key,
+                                                    BoundedPQueue<NodeIndex>& bqueue, double bound,
+                                                    size_t& checksLeft) const {
+    NodeIndex end = head + nodes[head].right;
+    for (NodeIndex i = head; i < end; ++i) {
+        if (erased[i]) continue;
+        double dist = SquaredDistance(points[i], key);
+        if (dist <= bound) bqueue.enqueue(i, dist);
+        if (--checksLeft == 0) return false;
+    }
+    return true;
+}
+
+// boxDistance returns the squared distance from key to the bounding box of
+// the subtree at node, which no point in the subtree is nearer than.
+template <size_t N, typename ElemType, typename CoordType>
+double KDTreeView<N, ElemType, CoordType>::boxDistance(NodeIndex node, const Point<N, CoordType>& key) const {
+    double result = 0.0;
+    for (size_t d = 0; d < N; ++d) {
+        double below = double(lower[node][d]) - double(key[d]);
+        double above = double(key[d]) - double(upper[node][d]);
+        double gap = max(0.0, max(below, above));
+        result += gap * gap;
+    }
+    return result;
+}
+
+// nearestNodes runs a k-nearest-neighbor search for key and leaves the
+// indices of the nodes found in context.bqueue, prioritized by squared
+// distance.
+// It only reads the tree, so any number of searches may run on it at once
+// as long as each has its own context.
+// With a positive epsilon the far side of a node is skipped as soon as the
+// split plane is more than worst / (1 + epsilon) away, so every neighbor
+// found is at most (1 + epsilon) times farther than the true one of the
+// same rank. The search stops after examining options.maxChecks points, and
+// never reports a point farther than options.maxDistance.
+// When the tree keeps bounding boxes, a subtree is skipped by how far its
+// box is from key rather than its split plane. The box is never nearer than
+// the plane, and in many dimensions it is usually much farther.
+template <size_t N, typename ElemType, typename CoordType>
+void KDTreeView<N, ElemType, CoordType>::nearestNodes(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                                               const KDSearchOptions& options) const {
+    // The queue never needs room for more points than there are
+    context.bqueue.reset(min(k, sz));
+    if (options.bestBinFirst) {
+        nearestNodesBestBin(key, context, options);
+        return;
+    }
+
+    // Both sides of the pruning test are squared
+    double scale = (1 + options.epsilon) * (1 + options.epsilon);
+    double bound = options.maxDistance * options.maxDistance;
+    size_t checksLeft = options.maxChecks == 0 ? SIZE_MAX : options.maxChecks;
+
+    // Recording of the search path
+    vector<NodeIndex>& search_path = context.path;
+    search_path.clear();
 
     // The Bounded Priority Queue
-    BoundedPQueue<ElemType> bqueue(k);
-    KDNode<N, ElemType> *curr = root;
-    while (curr != NULL) {
-        search_path.push(curr); // push current path node to stack
+    BoundedPQueue<NodeIndex>& bqueue = context.bqueue;
+    NodeIndex curr = root;
+    while (curr != NIL) {
+        if (nodes[curr].left == BUCKET) {
+            if (!scanBucket(curr, key, bqueue, bound, checksLeft)) return;
+            break;
+        }
+        search_path.push_back(curr); // push current path node to stack
 
-        // Distance is the priority for this bqueue
-        double dist = Distance(curr->position, key);
-        bqueue.enqueue(curr->element, dist);
+        // Squared distance is the priority for this bqueue
+        // Erased nodes still guide the search, but are never found
+        double dist = SquaredDistance(points[curr], key);
+        if (!erased[curr] && dist <= bound) bqueue.enqueue(curr, dist);
+        if (--checksLeft == 0) return;
 
-        if (key[curr->split] <= curr->position[curr->split]) {
-            curr = curr->left;
+        if (key[splits[curr]] <= points[curr][splits[curr]]) {
+            curr = nodes[curr].left;
         } else {
-            curr = curr->right;
+            curr = nodes[curr].right;
         }
     }
 
     // BackTracking
-    KDNode<N, ElemType> *path_end = search_path.top();
-    nearest = path_end->position;
-    min_dist = Distance(key, nearest);
-
     while (!search_path.empty()) {
-        curr = search_path.top();
-        KDNode<N, ElemType> *pkdnode = NULL;
-        search_path.pop();
-
-        // Calculate Distance
-        // if Distance is smaller, update the value
-        if (Distance(curr->position, key) < min_dist) {
-            nearest = curr->position;
-            min_dist = Distance(nearest, key);
+        curr = search_path.back();
+        NodeIndex pkdnode = NIL;
+        search_path.pop_back();
+
+        const Point<N, CoordType>& position = points[curr];
+        size_t split = splits[curr];
+        if (key[split] <= position[split]) {
+            pkdnode = nodes[curr].right;
+        } else {
+            pkdnode = nodes[curr].left;
         }
 
         // Calculate aligned Distance
         // If the intersection happens, we need to dig down to branches
-        if (bqueue.maxSize() != bqueue.size() ||
-                fabs(key[curr->split] - curr->position[curr->split]) < bqueue.worst()) {
-            if (key[curr->split] <= curr->position[curr->split]) {
-                pkdnode = curr->right;
-            } else {
-                pkdnode = curr->left;
-            }
-
+        // (compared squared, like the priorities)
+        double aligned = double(key[split]) - double(position[split]);
+        double planeDist = aligned * aligned;
+        if (pkdnode != NIL && lower != NULL) planeDist = boxDistance(pkdnode, key);
+        planeDist *= scale;
+        if (planeDist <= bound && (bqueue.maxSize() != bqueue.size() || planeDist < bqueue.worst())) {
             // A recursion to find the leaf node
-            while (pkdnode != NULL) {
-                search_path.push(pkdnode); // push current path node to stack
+            while (pkdnode != NIL) {
+                if (nodes[pkdnode].left == BUCKET) {
+                    if (!scanBucket(pkdnode, key, bqueue, bound, checksLeft)) return;
+                    break;
+                }
+                search_path.push_back(pkdnode); // push current path node to stack
 
-                // Distance is the priority for this bqueue
-                double dist = Distance(pkdnode->position, key);
-                bqueue.enqueue(pkdnode->element, dist);
+                // Squared distance is the priority for this bqueue
+                double dist = SquaredDistance(points[pkdnode], key);
+                if (!erased[pkdnode] && dist <= bound) bqueue.enqueue(pkdnode, dist);
+                if (--checksLeft == 0) return;
 
-                if (key[pkdnode->split] <= pkdnode->position[pkdnode->split]) {
-                    pkdnode = pkdnode->left;
+                if (key[splits[pkdnode]] <= points[pkdnode][splits[pkdnode]]) {
+                    pkdnode = nodes[pkdnode].left;
                 } else {
-                    pkdnode = pkdnode->right;
+                    pkdnode = nodes[pkdnode].right;
                 }
+
+                // The box of the near side can be too far as well
+                if (pkdnode != NIL && lower != NULL && bqueue.maxSize() == bqueue.size() &&
+                        boxDistance(pkdnode, key) * scale >= bqueue.worst())
+                    break;
             }
         }
 
 
     }
+}
+
+// nearestNodesBestBin is the best-bin-first version of nearestNodes. Instead
+// of backtracking in stack order, it keeps every branch it has not explored
+// in a heap ordered by how far the branch's cell is from key (the largest
+// squared split-plane distance on the way to it, or the squared distance to
+// its bounding box if the tree keeps them), and always descends into
+// the closest one next. The search ends when the closest branch cannot hold
+// a better neighbor, or when maxChecks points have been examined; the
+// neighbors found by then are the best of the most promising cells.
+template <size_t N, typename ElemType, typename CoordType>
+void KDTreeView<N, ElemType, CoordType>::nearestNodesBestBin(const Point<N, CoordType>& key, KNNQueryContext& context,
+                                                      const KDSearchOptions& options) const {
+    double scale = (1 + options.epsilon) * (1 + options.epsilon);
+    double bound = options.maxDistance * options.maxDistance;
+    size_t checksLeft = options.maxChecks == 0 ? SIZE_MAX : options.maxChecks;
+
+    // A min-heap of (distance to the cell, subtree root)
+    vector<Branch>& branches = context.branches;
+    branches.clear();
+    if (root == NIL) return;
+    branches.push_back(Branch(0, root));
+
+    BoundedPQueue<NodeIndex>& bqueue = context.bqueue;
+    while (!branches.empty()) {
+        pop_heap(branches.begin(), branches.end(), greater<Branch>());
+        Branch branch = branches.back();
+        branches.pop_back();
+
+        // Every other branch is at least as far, so none can help
+        if (branch.first * scale > bound) return;
+        if (bqueue.maxSize() == bqueue.size() && branch.first * scale >= bqueue.worst())
+            return;
+
+        // Descend to a leaf, queueing the far side of every node passed
+        NodeIndex curr = branch.second;
+        while (curr != NIL) {
+            if (nodes[curr].left == BUCKET) {
+                if (!scanBucket(curr, key, bqueue, bound, checksLeft)) return;
+                break;
+            }
+            double dist = SquaredDistance(points[curr], key);
+            if (!erased[curr] && dist <= bound) bqueue.enqueue(curr, dist);
+            if (--checksLeft == 0) return;
+
+            size_t split = splits[curr];
+            double aligned = double(key[split]) - double(points[curr][split]);
+            NodeIndex near = aligned <= 0 ? nodes[curr].left : nodes[curr].right;
+            NodeIndex far = aligned <= 0 ? nodes[curr].right : nodes[curr].left;
+
+            double farDist = max(branch.first, aligned * aligned);
+            if (far != NIL && lower != NULL) farDist = boxDistance(far, key);
+            if (far != NIL && farDist * scale <= bound &&
+                    (bqueue.maxSize() != bqueue.size() || farDist * scale < bqueue.worst())) {
+                branches.push_back(Branch(farDist, far));
+                push_heap(branches.begin(), branches.end(), greater<Branch>());
+            }
+            curr = near;
+        }
+    }
+}
+
+// majorityValue empties context.bqueue and returns the most frequent value
+// among the nodes in it. On a tie the value whose last vote came first in
+// order of distance wins. The votes are counted by sorting the positions of
+// the nodes by value, which takes no storage beyond the context's.
+template <size_t N, typename ElemType, typename CoordType>
+ElemType KDTreeView<N, ElemType, CoordType>::majorityValue(KNNQueryContext& context) const {
+    vector<NodeIndex>& nearest = context.nearest;
+    vector<NodeIndex>& byValue = context.byValue;
+    nearest.clear();
+    byValue.clear();
+    while (!context.bqueue.empty()) {
+        byValue.push_back(NodeIndex(nearest.size()));
+        nearest.push_back(context.bqueue.dequeueMin());
+    }
+    if (nearest.empty()) return ElemType();
+
+    // Equal values end up next to each other, nearest first
+    sort(byValue.begin(), byValue.end(), [&] (NodeIndex one, NodeIndex two) {
+        const ElemType& a = elems[nearest[one]];
+        const ElemType& b = elems[nearest[two]];
+        if (a < b) return true;
+        if (b < a) return false;
+        return one < two;
+    });
+
+    size_t best = 0, bestCount = 0;
+    for (size_t first = 0, last; first < byValue.size(); first = last) {
+        last = first + 1;
+        while (last < byValue.size() && !(elems[nearest[byValue[first]]] < elems[nearest[byValue[last]]]))
+            ++last;
+        if (last - first > bestCount || (last - first == bestCount && byValue[last - 1] < byValue[best])) {
+            best = last - 1;
+            bestCount = last - first;
+        }
+    }
+    return elems[nearest[byValue[best]]];
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+ElemType KDTreeView<N, ElemType, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                               const KDSearchOptions& options) const {
+    KNNQueryContext context;
+    return kNNValue(key, k, context, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+ElemType KDTreeView<N, ElemType, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                               KNNQueryContext& context, const KDSearchOptions& options) const {
+    nearestNodes(key, k, context, options);
 
     // Return the frequent value
-    map<ElemType, int> elemCount;
-    ElemType ret;
-    int maxcount = -1;
+    return majorityValue(context);
+}
+
+// drainNeighbors empties bqueue into out, nearest first, and returns how
+// many neighbors it wrote.
+template <size_t N, typename ElemType, typename CoordType>
+size_t KDTreeView<N, ElemType, CoordType>::drainNeighbors(BoundedPQueue<NodeIndex>& bqueue, Neighbor* out) const {
+    size_t count = 0;
     while (!bqueue.empty()) {
-        ElemType cur = bqueue.dequeueMin();
-        elemCount[cur] += 1;
-        if (elemCount[cur] > maxcount) {
-            maxcount = elemCount[cur];
-            ret = cur;
+        out[count].distance = sqrt(bqueue.best());
+        NodeIndex node = bqueue.dequeueMin();
+        out[count].point = points[node];
+        out[count].value = elems[node];
+        ++count;
+    }
+    return count;
+}
+
+// forEachNearest runs the search of kNearest and calls visit(node, distance)
+// for every node found, nearest first, without touching the node's value.
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Visitor>
+void KDTreeView<N, ElemType, CoordType>::forEachNearest(const Point<N, CoordType>& key, size_t k,
+                                                        KNNQueryContext& context, const KDSearchOptions& options,
+                                                        Visitor visit) const {
+    nearestNodes(key, k, context, options);
+    while (!context.bqueue.empty()) {
+        double distance = sqrt(context.bqueue.best());
+        visit(context.bqueue.dequeueMin(), distance);
+    }
+}
+
+// kNearest reuses the elements already in neighbors, so once the buffer has
+// room for k neighbors, writing the results does not allocate.
+template <size_t N, typename ElemType, typename CoordType>
+size_t KDTreeView<N, ElemType, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                             const KDSearchOptions& options) const {
+    KNNQueryContext context;
+    return kNearest(key, k, neighbors, context, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t KDTreeView<N, ElemType, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                             KNNQueryContext& context, const KDSearchOptions& options) const {
+    nearestNodes(key, k, context, options);
+    neighbors.resize(context.bqueue.size());
+    return drainNeighbors(context.bqueue, neighbors.data());
+}
+
+// forEachQueryBatch calls run(context, i) for every i below count on up to
+// threads threads. Every thread gets its own context and claims queries in
+// small chunks, so uneven query costs still balance out.
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Function>
+void KDTreeView<N, ElemType, CoordType>::forEachQueryBatch(size_t count, size_t threads, Function run) const {
+    const size_t chunk = 64;
+    atomic<size_t> next(0);
+    auto worker = [&] {
+        KNNQueryContext context;
+        while (true) {
+            size_t begin = next.fetch_add(chunk);
+            if (begin >= count) break;
+            size_t end = min(count, begin + chunk);
+            for (size_t i = begin; i < end; ++i)
+                run(context, i);
         }
+    };
 
+    if (threads == 1 || count <= chunk) {
+        worker();
+        return;
     }
 
-    return ret;
+    TaskPool pool(threads);
+    TaskGroup group;
+    TaskGroupWaiter waiter(pool, group);
+    size_t tasks = min(pool.threadCount(), (count + chunk - 1) / chunk);
+    for (size_t i = 0; i < tasks; ++i)
+        pool.spawn(group, worker);
+    waiter.wait();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+vector<ElemType> KDTreeView<N, ElemType, CoordType>::kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads,
+                                                            const KDSearchOptions& options) const {
+    vector<ElemType> result(keys.size());
+    forEachQueryBatch(keys.size(), threads, [&] (KNNQueryContext& context, size_t i) {
+        result[i] = kNNValue(keys[i], k, context, options);
+    });
+    return result;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t KDTreeView<N, ElemType, CoordType>::kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                                                  vector<Neighbor>& neighbors, size_t threads,
+                                                  const KDSearchOptions& options) const {
+    size_t stride = min(k, sz);
+    neighbors.resize(keys.size() * stride);
+    if (stride == 0) return 0;
+
+    // Marks the slots a search cut short leaves unused
+    Neighbor unused = Neighbor();
+    unused.distance = numeric_limits<double>::infinity();
+
+    forEachQueryBatch(keys.size(), threads, [&] (KNNQueryContext& context, size_t i) {
+        nearestNodes(keys[i], k, context, options);
+        Neighbor *row = &neighbors[i * stride];
+        fill(row + drainNeighbors(context.bqueue, row), row + stride, unused);
+    });
+    return stride;
+}
+
+
+
+// forEachInRange calls visit(i) for every node i whose point lies in the box
+// [lo, hi]. A node's left subtree only holds keys below its own along its
+// split, and its right subtree keys at or above it, so a subtree is skipped
+// as soon as the box lies entirely on the other side of the node. Buckets
+// are checked point by point.
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Visitor>
+void KDTreeView<N, ElemType, CoordType>::forEachInRange(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, Visitor visit) const {
+    if (root == NIL) return;
+
+    vector<NodeIndex> pending(1, root);
+    while (!pending.empty()) {
+        NodeIndex curr = pending.back();
+        pending.pop_back();
+
+        if (nodes[curr].left == BUCKET) {
+            NodeIndex end = curr + nodes[curr].right;
+            for (NodeIndex j = curr; j < end; ++j) {
+                bool inside = !erased[j];
+                for (size_t i = 0; i < N && inside; ++i)
+                    inside = lo[i] <= points[j][i] && points[j][i] <= hi[i];
+                if (inside) visit(j);
+            }
+            continue;
+        }
+
+        const Point<N, CoordType>& position = points[curr];
+        size_t split = splits[curr];
+
+        bool inside = true;
+        for (size_t i = 0; i < N && inside; ++i)
+            inside = lo[i] <= position[i] && position[i] <= hi[i];
+        if (inside && !erased[curr]) visit(curr);
+
+        if (nodes[curr].left != NIL && lo[split] < position[split])
+            pending.push_back(nodes[curr].left);
+        if (nodes[curr].right != NIL && hi[split] >= position[split])
+            pending.push_back(nodes[curr].right);
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTreeView<N, ElemType, CoordType>::rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const {
+    forEachInRange(lo, hi, [&] (NodeIndex i) {
+        *out = KDPair(points[i], elems[i]);
+        ++out;
+    });
+    return out;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t KDTreeView<N, ElemType, CoordType>::rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const {
+    size_t count = 0;
+    forEachInRange(lo, hi, [&] (NodeIndex) { ++count; });
+    return count;
+}
+
+// forEachInRadius calls visit(i, squaredDistance) for every node i whose
+// point lies within radius of key, until visit returns false. A subtree is
+// skipped when the ball lies entirely on the other side of the node's split
+// plane. The near side of each node is searched first.
+// A point is in the ball when sqrt(squaredDistance), the distance searches
+// report, is at most radius. Comparing squared distances with radius * radius
+// gives the same answer except within a few ulps of the boundary, where the
+// rounding of either side can tip it; only there is the square root taken.
+// Pruning allows the same slack, so no point it skips could have made it in.
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Visitor>
+void KDTreeView<N, ElemType, CoordType>::forEachInRadius(const Point<N, CoordType>& key, double radius, Visitor visit) const {
+    if (root == NIL || !(radius >= 0)) return;
+
+    const double slack = 8 * numeric_limits<double>::epsilon();
+    double squaredRadius = radius * radius;
+    double surelyIn = squaredRadius * (1 - slack), surelyOut = squaredRadius * (1 + slack);
+    double reach = radius * (1 + slack);
+    auto inBall = [&] (double dist) {
+        return dist <= surelyIn || (dist <= surelyOut && sqrt(dist) <= radius);
+    };
+
+    vector<NodeIndex> pending(1, root);
+    while (!pending.empty()) {
+        NodeIndex curr = pending.back();
+        pending.pop_back();
+
+        if (nodes[curr].left == BUCKET) {
+            NodeIndex end = curr + nodes[curr].right;
+            for (NodeIndex j = curr; j < end; ++j) {
+                if (erased[j]) continue;
+                double dist = SquaredDistance(points[j], key);
+                if (inBall(dist) && !visit(j, dist)) return;
+            }
+            continue;
+        }
+
+        const Point<N, CoordType>& position = points[curr];
+        size_t split = splits[curr];
+
+        double dist = SquaredDistance(position, key);
+        if (!erased[curr] && inBall(dist) && !visit(curr, dist)) return;
+
+        // Left keys are < position[split], right keys are >= it
+        double aligned = double(key[split]) - double(position[split]);
+        NodeIndex near = aligned < 0 ? nodes[curr].left : nodes[curr].right;
+        NodeIndex far = aligned < 0 ? nodes[curr].right : nodes[curr].left;
+
+        if (far != NIL && fabs(aligned) <= reach) pending.push_back(far);
+        if (near != NIL) pending.push_back(near);
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTreeView<N, ElemType, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const {
+    forEachInRadius(key, radius, [&] (NodeIndex i, double dist) {
+        Neighbor found = {points[i], elems[i], sqrt(dist)};
+        *out = found;
+        ++out;
+        return true;
+    });
+    return out;
+}
 
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator KDTreeView<N, ElemType, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                                         size_t maxResults) const {
+    if (maxResults == 0) return out;
+
+    size_t count = 0;
+    forEachInRadius(key, radius, [&] (NodeIndex i, double dist) {
+        Neighbor found = {points[i], elems[i], sqrt(dist)};
+        *out = found;
+        ++out;
+        return ++count < maxResults;
+    });
+    return out;
 }
 
 
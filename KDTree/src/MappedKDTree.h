@@ -0,0 +1,444 @@
+/**
+ * File: MappedKDTree.h
+ * ------------------------
+ * A read-only KDTree that lives in a file. A built KDTree is saved as a flat
+ * copy of its node arrays, and opening the file maps it into memory instead
+ * of reading it, so the tree can be searched right away:
+ *
+ * MappedKDTree<3, int>::save(kd, "index.kdt");   // Once, after building kd
+ * MappedKDTree<3, int> index("index.kdt");       // At every start
+ * int value = index.kNNValue(key, 5);
+ *
+ * Nothing is deserialized: opening a file takes the same time whatever its
+ * size, and pages of the tree are only read from disk when a search first
+ * touches them. Every process that maps the same file shares one copy of it
+ * in the page cache.
+ *
+ * Only trees whose values are trivially copyable can be saved, since the
+ * values are stored as their bytes. The file holds no pointers, but it does
+ * depend on the byte order and the type sizes of the machine that wrote it;
+ * opening a file written for other types or another byte order throws.
+ *
+ * The file starts with a KDFileHeader. Each node array follows, starting at
+ * an offset the header records, which is a multiple of 64:
+ *
+ *     points    Point<N, CoordType>[nodeCount]
+ *     elems     ElemType[nodeCount]
+ *     splits    uint32_t[nodeCount]
+ *     nodes     KDNode[nodeCount]
+ *     erased    unsigned char[nodeCount]
+ *
+ * These are the arrays of the KDTree as they were, so erased nodes and slots
+ * left over from rebuilds are saved along with the rest. Version 2 added leaf
+ * buckets; version 1 files hold trees without buckets and are still read.
+ * Bounding boxes the tree keeps are not saved, and searches of a mapped tree
+ * prune by the split planes alone.
+ *
+ * MappedKDTree is POSIX-only: it maps files with mmap, and on Windows
+ * (_WIN32) this header declares nothing.
+ */
+
+#ifndef MAPPED_KDTREE_INCLUDED
+#define MAPPED_KDTREE_INCLUDED
+#ifndef _WIN32
+
+#include "KDTree.h"
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// The header at the start of a KDTree file.
+struct KDFileHeader {
+    char magic[8];              // KD_FILE_MAGIC
+    uint32_t version;           // KD_FILE_VERSION
+    uint32_t byteOrder;         // KD_FILE_BYTE_ORDER as the writer stored it
+    uint32_t dimension;         // N
+    uint32_t coordSize;         // Size of one coordinate of a point
+    uint64_t elemSize;          // Size of one value
+    uint64_t nodeCount;         // Entries in each node array
+    uint64_t size;              // Points in the tree, erased ones left out
+    uint32_t root;              // Index of the root node, NIL when empty
+    uint32_t coordKind;         // KD_FILE_FLOATING, KD_FILE_SIGNED or KD_FILE_UNSIGNED
+    uint64_t pointsOffset;      // Where each node array starts
+    uint64_t elemsOffset;
+    uint64_t splitsOffset;
+    uint64_t nodesOffset;
+    uint64_t erasedOffset;
+    uint64_t fileSize;
+};
+
+const char KD_FILE_MAGIC[8] = {'K', 'D', 'T', 'R', 'E', 'E', '\r', '\n'};
+const uint32_t KD_FILE_VERSION = 2;
+const uint32_t KD_FILE_BYTE_ORDER = 0x01020304;
+
+// Kinds of coordinates
+const uint32_t KD_FILE_FLOATING = 0;
+const uint32_t KD_FILE_SIGNED = 1;
+const uint32_t KD_FILE_UNSIGNED = 2;
+
+template <size_t N, typename ElemType, typename CoordType = double>
+class MappedKDTree {
+public:
+    typedef pair<Point<N, CoordType>, ElemType> KDPair;
+    typedef KDNeighbor<N, ElemType, CoordType> Neighbor;
+
+    // Constructor: MappedKDTree(const string& filename);
+    // Usage: MappedKDTree<3, int> index("index.kdt");
+    // ----------------------------------------------------
+    // Maps the KDTree saved in filename. Throws a runtime_error if the file
+    // cannot be mapped or does not hold a tree of this type.
+    explicit MappedKDTree(const string& filename);
+
+    // Destructor: ~MappedKDTree();
+    // Usage: (implicit)
+    // ----------------------------------------------------
+    // Unmaps the file.
+    ~MappedKDTree();
+
+    // MappedKDTree(MappedKDTree&& rhs);
+    // MappedKDTree& operator=(MappedKDTree&& rhs);
+    // Usage: MappedKDTree<3, int> index = openIndex();
+    // ----------------------------------------------------
+    // Hands the mapping over to another MappedKDTree, leaving rhs empty.
+    MappedKDTree(MappedKDTree&& rhs) noexcept;
+    MappedKDTree& operator=(MappedKDTree&& rhs);
+
+    // static void save(const KDTree<N, ElemType, Alloc, CoordType>& kd, const string& filename);
+    // Usage: MappedKDTree<3, int>::save(kd, "index.kdt");
+    // ----------------------------------------------------
+    // Writes kd to filename. The file is written under a temporary name and
+    // then renamed, so processes that have the old file mapped keep their
+    // copy, and no process ever maps a half written one. Throws a
+    // runtime_error if the file cannot be written.
+    template <typename Alloc>
+    static void save(const KDTree<N, ElemType, Alloc, CoordType>& kd, const string& filename);
+
+    // size_t dimension() const;
+    // size_t size() const;
+    // bool empty() const;
+    // bool contains(const Point<N, CoordType>& pt) const;
+    // Usage: if (index.contains(pt))
+    // ----------------------------------------------------
+    // The same as for KDTree.
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+    bool contains(const Point<N, CoordType>& pt) const;
+
+    // const ElemType& at(const Point<N, CoordType>& pt) const;
+    // Usage: cout << index.at(v) << endl;
+    // ----------------------------------------------------
+    // Returns a reference into the mapped file to the value associated with
+    // pt. If the point is not there, this function throws an out_of_range
+    // exception.
+    const ElemType& at(const Point<N, CoordType>& pt) const;
+
+    // The searches of KDTree, which documents them. Any number of them may
+    // run on a MappedKDTree at once.
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k,
+                      const KDSearchOptions& options = KDSearchOptions()) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    const KDSearchOptions& options = KDSearchOptions()) const;
+    ElemType kNNValue(const Point<N, CoordType>& key, size_t k, KNNQueryContext& context,
+                      const KDSearchOptions& options = KDSearchOptions()) const;
+    size_t kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                    KNNQueryContext& context, const KDSearchOptions& options = KDSearchOptions()) const;
+    vector<ElemType> kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads = 0,
+                                   const KDSearchOptions& options = KDSearchOptions()) const;
+    size_t kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                         vector<Neighbor>& neighbors, size_t threads = 0,
+                         const KDSearchOptions& options = KDSearchOptions()) const;
+    template <typename OutputIterator>
+    OutputIterator rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const;
+    size_t rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const;
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const;
+    template <typename OutputIterator>
+    OutputIterator radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                size_t maxResults) const;
+
+private:
+    typedef KDTreeView<N, ElemType, CoordType> View;
+
+    static_assert(is_trivially_copyable<ElemType>::value,
+                  "Only values that are trivially copyable can be stored in a file");
+
+    // Arrays start at multiples of this many bytes
+    const static size_t SECTION_ALIGNMENT = 64;
+
+    static uint32_t coordKind();
+    static uint64_t alignSection(uint64_t offset);
+    static void writeSection(ofstream& out, uint64_t& written, uint64_t offset,
+                             const void* data, size_t bytes);
+    void unmap();
+
+    View tree;              // The node arrays, pointing into the mapping
+    void *mapping;          // The mapped file, NULL if there is none
+    size_t mappingSize;
+
+    MappedKDTree(const MappedKDTree&);
+    MappedKDTree& operator=(const MappedKDTree&);
+};
+
+/** MappedKDTree class implementation details */
+
+template <size_t N, typename ElemType, typename CoordType>
+uint32_t MappedKDTree<N, ElemType, CoordType>::coordKind() {
+    if (!is_integral<CoordType>::value) return KD_FILE_FLOATING;
+    return is_signed<CoordType>::value ? KD_FILE_SIGNED : KD_FILE_UNSIGNED;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+uint64_t MappedKDTree<N, ElemType, CoordType>::alignSection(uint64_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+// writeSection pads the file with zeros up to offset, then writes the array.
+template <size_t N, typename ElemType, typename CoordType>
+void MappedKDTree<N, ElemType, CoordType>::writeSection(ofstream& out, uint64_t& written, uint64_t offset,
+                                                        const void* data, size_t bytes) {
+    static const char zeros[SECTION_ALIGNMENT] = {};
+    out.write(zeros, offset - written);
+    out.write(static_cast<const char*>(data), bytes);
+    written = offset + bytes;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename Alloc>
+void MappedKDTree<N, ElemType, CoordType>::save(const KDTree<N, ElemType, Alloc, CoordType>& kd, const string& filename) {
+    View tree = kd.view();
+    uint64_t count = kd.elems.size();
+
+    KDFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KD_FILE_MAGIC, sizeof(header.magic));
+    header.version = KD_FILE_VERSION;
+    header.byteOrder = KD_FILE_BYTE_ORDER;
+    header.dimension = N;
+    header.coordSize = sizeof(CoordType);
+    header.coordKind = coordKind();
+    header.elemSize = sizeof(ElemType);
+    header.nodeCount = count;
+    header.size = tree.sz;
+    header.root = tree.root;
+    header.pointsOffset = alignSection(sizeof(header));
+    header.elemsOffset = alignSection(header.pointsOffset + count * sizeof(Point<N, CoordType>));
+    header.splitsOffset = alignSection(header.elemsOffset + count * sizeof(ElemType));
+    header.nodesOffset = alignSection(header.splitsOffset + count * sizeof(uint32_t));
+    header.erasedOffset = alignSection(header.nodesOffset + count * sizeof(KDNode));
+    header.fileSize = header.erasedOffset + count;
+
+    string temporary = filename + ".tmp";
+    {
+        ofstream out(temporary.c_str(), ios::binary | ios::trunc);
+        uint64_t written = 0;
+        writeSection(out, written, 0, &header, sizeof(header));
+        writeSection(out, written, header.pointsOffset, tree.points, count * sizeof(Point<N, CoordType>));
+        writeSection(out, written, header.elemsOffset, tree.elems, count * sizeof(ElemType));
+        writeSection(out, written, header.splitsOffset, tree.splits, count * sizeof(uint32_t));
+        writeSection(out, written, header.nodesOffset, tree.nodes, count * sizeof(KDNode));
+        writeSection(out, written, header.erasedOffset, tree.erased, count);
+        out.close();
+        if (!out) {
+            remove(temporary.c_str());
+            throw runtime_error("Cannot write KDTree file " + filename);
+        }
+    }
+
+    if (rename(temporary.c_str(), filename.c_str()) != 0) {
+        remove(temporary.c_str());
+        throw runtime_error("Cannot write KDTree file " + filename);
+    }
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+MappedKDTree<N, ElemType, CoordType>::MappedKDTree(const string& filename) : mapping(NULL), mappingSize(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Cannot open KDTree file " + filename);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < off_t(sizeof(KDFileHeader))) {
+        close(fd);
+        throw runtime_error("Not a KDTree file: " + filename);
+    }
+
+    mappingSize = info.st_size;
+    void *start = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (start == MAP_FAILED) throw runtime_error("Cannot map KDTree file " + filename);
+    mapping = start;
+
+    // Check everything the searches rely on, short of reading the arrays
+    const KDFileHeader& header = *static_cast<const KDFileHeader*>(mapping);
+    uint64_t count = header.nodeCount;
+    bool valid = memcmp(header.magic, KD_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version >= 1 && header.version <= KD_FILE_VERSION;
+    bool matches = header.byteOrder == KD_FILE_BYTE_ORDER && header.dimension == N &&
+                   header.coordSize == sizeof(CoordType) && header.coordKind == coordKind() &&
+                   header.elemSize == sizeof(ElemType);
+    bool fits = header.fileSize == mappingSize && count < View::NIL && header.size <= count &&
+                (header.root == View::NIL ? header.size == 0 : header.root < count) &&
+                header.pointsOffset % SECTION_ALIGNMENT == 0 &&
+                header.elemsOffset % SECTION_ALIGNMENT == 0 &&
+                header.splitsOffset % SECTION_ALIGNMENT == 0 &&
+                header.nodesOffset % SECTION_ALIGNMENT == 0 &&
+                header.pointsOffset >= sizeof(header) &&
+                header.pointsOffset + count * sizeof(Point<N, CoordType>) <= header.elemsOffset &&
+                header.elemsOffset + count * sizeof(ElemType) <= header.splitsOffset &&
+                header.splitsOffset + count * sizeof(uint32_t) <= header.nodesOffset &&
+                header.nodesOffset + count * sizeof(KDNode) <= header.erasedOffset &&
+                header.erasedOffset + count <= mappingSize;
+    if (!valid || !matches || !fits) {
+        unmap();
+        if (!valid) throw runtime_error("Not a KDTree file: " + filename);
+        if (!matches) throw runtime_error("KDTree file holds another type of tree: " + filename);
+        throw runtime_error("KDTree file is damaged: " + filename);
+    }
+
+    const char *base = static_cast<const char*>(mapping);
+    tree.points = reinterpret_cast<const Point<N, CoordType>*>(base + header.pointsOffset);
+    tree.elems = reinterpret_cast<const ElemType*>(base + header.elemsOffset);
+    tree.splits = reinterpret_cast<const uint32_t*>(base + header.splitsOffset);
+    tree.nodes = reinterpret_cast<const KDNode*>(base + header.nodesOffset);
+    tree.erased = reinterpret_cast<const unsigned char*>(base + header.erasedOffset);
+    tree.root = header.root;
+    tree.sz = header.size;
+
+    // Bounding boxes are not saved, so searches prune by the split planes
+    tree.lower = NULL;
+    tree.upper = NULL;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+MappedKDTree<N, ElemType, CoordType>::~MappedKDTree() {
+    unmap();
+}
+
+// unmap releases the mapping and leaves an empty tree behind.
+template <size_t N, typename ElemType, typename CoordType>
+void MappedKDTree<N, ElemType, CoordType>::unmap() {
+    if (mapping != NULL) munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    View empty = {NULL, NULL, NULL, NULL, NULL, View::NIL, 0, NULL, NULL};
+    tree = empty;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+MappedKDTree<N, ElemType, CoordType>::MappedKDTree(MappedKDTree&& rhs) noexcept
+    : tree(rhs.tree), mapping(rhs.mapping), mappingSize(rhs.mappingSize) {
+    rhs.mapping = NULL;
+    rhs.unmap();
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+MappedKDTree<N, ElemType, CoordType>& MappedKDTree<N, ElemType, CoordType>::operator=(MappedKDTree&& rhs) {
+    if (this != &rhs) {
+        unmap();
+        tree = rhs.tree;
+        mapping = rhs.mapping;
+        mappingSize = rhs.mappingSize;
+        rhs.mapping = NULL;
+        rhs.unmap();
+    }
+    return *this;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::size() const {
+    return tree.sz;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool MappedKDTree<N, ElemType, CoordType>::empty() const {
+    return tree.sz == 0;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+bool MappedKDTree<N, ElemType, CoordType>::contains(const Point<N, CoordType>& pt) const {
+    return tree.find(pt) != View::NIL;
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+const ElemType& MappedKDTree<N, ElemType, CoordType>::at(const Point<N, CoordType>& pt) const {
+    NodeIndex cur = tree.find(pt);
+    if (cur == View::NIL) throw out_of_range("No Point in KDTREE");
+    return tree.elems[cur];
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+ElemType MappedKDTree<N, ElemType, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                                        const KDSearchOptions& options) const {
+    return tree.kNNValue(key, k, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                                      const KDSearchOptions& options) const {
+    return tree.kNearest(key, k, neighbors, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+ElemType MappedKDTree<N, ElemType, CoordType>::kNNValue(const Point<N, CoordType>& key, size_t k,
+                                                        KNNQueryContext& context, const KDSearchOptions& options) const {
+    return tree.kNNValue(key, k, context, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::kNearest(const Point<N, CoordType>& key, size_t k, vector<Neighbor>& neighbors,
+                                                      KNNQueryContext& context, const KDSearchOptions& options) const {
+    return tree.kNearest(key, k, neighbors, context, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+vector<ElemType> MappedKDTree<N, ElemType, CoordType>::kNNValueBatch(const vector<Point<N, CoordType> >& keys, size_t k, size_t threads,
+                                                                     const KDSearchOptions& options) const {
+    return tree.kNNValueBatch(keys, k, threads, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::kNearestBatch(const vector<Point<N, CoordType> >& keys, size_t k,
+                                                           vector<Neighbor>& neighbors, size_t threads,
+                                                           const KDSearchOptions& options) const {
+    return tree.kNearestBatch(keys, k, neighbors, threads, options);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator MappedKDTree<N, ElemType, CoordType>::rangeQuery(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi, OutputIterator out) const {
+    return tree.rangeQuery(lo, hi, out);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+size_t MappedKDTree<N, ElemType, CoordType>::rangeCount(const Point<N, CoordType>& lo, const Point<N, CoordType>& hi) const {
+    return tree.rangeCount(lo, hi);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator MappedKDTree<N, ElemType, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out) const {
+    return tree.radiusSearch(key, radius, out);
+}
+
+template <size_t N, typename ElemType, typename CoordType>
+template <typename OutputIterator>
+OutputIterator MappedKDTree<N, ElemType, CoordType>::radiusSearch(const Point<N, CoordType>& key, double radius, OutputIterator out,
+                                                                  size_t maxResults) const {
+    return tree.radiusSearch(key, radius, out, maxResults);
+}
+
+#endif // _WIN32
+#endif // MAPPED_KDTREE_INCLUDED
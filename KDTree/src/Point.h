@@ -5,13 +5,22 @@
  * templates you've seen before, Point is parameterized over an integer rather
  * than a type. This allows the compiler to verify that the type is being used
  * correctly.
+ *
+ * The coordinates are doubles unless another arithmetic type is given as the
+ * second template argument. Point<128, float> takes half the memory of
+ * Point<128>, and Point<2, int32_t> holds fixed-point coordinates such as
+ * degrees scaled by 10^7. Distances are doubles whatever the coordinate type:
+ * differences of integer coordinates are taken in 64 bits so they cannot
+ * overflow, and every difference is squared and summed in double precision.
  */
 #ifndef POINT_INCLUDED
 #define POINT_INCLUDED
 
 #include <cmath>
+#include <cstdint>
+#include <type_traits>
 
-template <size_t N>
+template <size_t N, typename T = double>
 class Point {
 public:
     // Type: iterator
@@ -19,8 +28,8 @@ public:
     // ------------------------------------------------------------------------
     // Types representing iterators that can traverse and optionally modify the
     // elements of the Point.
-    typedef double* iterator;
-    typedef const double* const_iterator;
+    typedef T* iterator;
+    typedef const T* const_iterator;
     
     // size_t size() const;
     // Usage: for (size_t i = 0; i < myPoint.size(); ++i)
@@ -28,14 +37,14 @@ public:
     // Returns N, the dimension of the point.
     size_t size() const;
     
-    // double& operator[](size_t index);
-    // double operator[](size_t index) const;
+    // T& operator[](size_t index);
+    // T operator[](size_t index) const;
     // Usage: myPoint[3] = 137;
     // ------------------------------------------------------------------------
     // Queries or retrieves the value of the point at a particular point. The
     // index is assumed to be in-range.
-    double& operator[](size_t index);
-    double operator[](size_t index) const;
+    T& operator[](size_t index);
+    T operator[](size_t index) const;
     
     // iterator begin();
     // iterator end();
@@ -52,86 +61,278 @@ public:
 
 private:
     // The point's actual coordinates are stored in an array.
-    double coords[N];
+    T coords[N];
 };
 
-// double Distance(const Point<N>& one, const Point<N>& two);
+// double Distance(const Point<N, T>& one, const Point<N, T>& two);
 // Usage: double d = Distance(one, two);
 // ----------------------------------------------------------------------------
 // Returns the Euclidean distance between two points.
-template <size_t N>
-double Distance(const Point<N>& one, const Point<N>& two);
+template <size_t N, typename T>
+double Distance(const Point<N, T>& one, const Point<N, T>& two);
+
+// double SquaredDistance(const Point<N, T>& one, const Point<N, T>& two);
+// Usage: if (SquaredDistance(one, two) < bestSoFar)
+// ----------------------------------------------------------------------------
+// Returns the square of the Euclidean distance between two points. It orders
+// points the same way Distance does but skips the square root, so searches
+// should compare squared distances and only take the root of a final result.
+template <size_t N, typename T>
+double SquaredDistance(const Point<N, T>& one, const Point<N, T>& two);
 
-// bool operator==(const Point<N>& one, const Point<N>& two);
-// bool operator!=(const Point<N>& one, const Point<N>& two);
+// bool operator==(const Point<N, T>& one, const Point<N, T>& two);
+// bool operator!=(const Point<N, T>& one, const Point<N, T>& two);
 // Usage: if (one == two)
 // ----------------------------------------------------------------------------
 // Returns whether two points are equal or not equal.
-template <size_t N>
-bool operator==(const Point<N>& one, const Point<N>& two);
+template <size_t N, typename T>
+bool operator==(const Point<N, T>& one, const Point<N, T>& two);
 
-template <size_t N>
-bool operator!=(const Point<N>& one, const Point<N>& two);
+template <size_t N, typename T>
+bool operator!=(const Point<N, T>& one, const Point<N, T>& two);
 
 /** Point class implementation details */
 
 #include <algorithm>
 
+// The distance and comparison kernels below are vectorized when the compiler
+// targets SSE2 (two doubles per instruction) or AVX (four doubles), which is
+// decided at compile time from the target flags. Float coordinates are
+// widened to doubles as they are loaded.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define POINT_SIMD_WIDTH 4
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define POINT_SIMD_WIDTH 2
+#else
+#define POINT_SIMD_WIDTH 1
+#endif
+
+// PointDifference<T>::type is the type the difference of two coordinates is
+// taken in before it is squared: 64-bit integers for integer coordinates,
+// double otherwise.
+template <typename T, bool Integral = std::is_integral<T>::value>
+struct PointDifference {
+    typedef double type;
+};
+
+template <typename T>
+struct PointDifference<T, true> {
+    typedef int64_t type;
+};
+
+// Returns the square of the difference of two coordinates, in double
+// precision.
+template <typename T>
+inline double SquaredDifference(T one, T two) {
+    typedef typename PointDifference<T>::type Difference;
+    double diff = double(Difference(one) - Difference(two));
+    return diff * diff;
+}
+
+// PointKernel<N, T> holds the inner loops over the coordinates of two points.
+// The generic version is a plain loop, and points of two, three and four
+// coordinates, which most trees hold, get its terms written out, so nothing
+// is left to loop over. The specializations further below are picked for
+// double and float coordinates whenever N fills at least one SIMD register,
+// and handle whatever does not fill a whole register with narrower steps.
+// Up to three coordinates, every version adds the terms up in order, so
+// distances come out the same whichever kernel computes them. From four on
+// the SIMD kernels add them up lane by lane, which may round differently.
+template <size_t N, typename T,
+          bool Vectorized = (POINT_SIMD_WIDTH > 1 && N >= 2 &&
+                             (std::is_same<T, double>::value || std::is_same<T, float>::value))>
+struct PointKernel {
+    static double squaredDistance(const T* one, const T* two) {
+        double result = 0.0;
+        for (size_t i = 0; i < N; ++i)
+            result += SquaredDifference(one[i], two[i]);
+        return result;
+    }
+
+    static bool equal(const T* one, const T* two) {
+        return std::equal(one, one + N, two);
+    }
+};
+
+template <typename T>
+struct PointKernel<2, T, false> {
+    static double squaredDistance(const T* one, const T* two) {
+        return SquaredDifference(one[0], two[0]) + SquaredDifference(one[1], two[1]);
+    }
+
+    static bool equal(const T* one, const T* two) {
+        return one[0] == two[0] && one[1] == two[1];
+    }
+};
+
+template <typename T>
+struct PointKernel<3, T, false> {
+    static double squaredDistance(const T* one, const T* two) {
+        return SquaredDifference(one[0], two[0]) + SquaredDifference(one[1], two[1]) +
+               SquaredDifference(one[2], two[2]);
+    }
+
+    static bool equal(const T* one, const T* two) {
+        return one[0] == two[0] && one[1] == two[1] && one[2] == two[2];
+    }
+};
+
+template <typename T>
+struct PointKernel<4, T, false> {
+    static double squaredDistance(const T* one, const T* two) {
+        return SquaredDifference(one[0], two[0]) + SquaredDifference(one[1], two[1]) +
+               SquaredDifference(one[2], two[2]) + SquaredDifference(one[3], two[3]);
+    }
+
+    static bool equal(const T* one, const T* two) {
+        return one[0] == two[0] && one[1] == two[1] && one[2] == two[2] && one[3] == two[3];
+    }
+};
+
+#if POINT_SIMD_WIDTH > 1
+template <size_t N>
+struct PointKernel<N, double, true> {
+    static double squaredDistance(const double* one, const double* two) {
+        size_t i = 0;
+        __m128d sum2 = _mm_setzero_pd();
+#if POINT_SIMD_WIDTH >= 4
+        if (N >= 4) {
+            __m256d sum4 = _mm256_setzero_pd();
+            for (; i + 4 <= N; i += 4) {
+                __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(one + i), _mm256_loadu_pd(two + i));
+                sum4 = _mm256_add_pd(sum4, _mm256_mul_pd(diff, diff));
+            }
+            sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4), _mm256_extractf128_pd(sum4, 1));
+        }
+#endif
+        for (; i + 2 <= N; i += 2) {
+            __m128d diff = _mm_sub_pd(_mm_loadu_pd(one + i), _mm_loadu_pd(two + i));
+            sum2 = _mm_add_pd(sum2, _mm_mul_pd(diff, diff));
+        }
+        double result = _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+        if (i < N)
+            result += (one[i] - two[i]) * (one[i] - two[i]);
+        return result;
+    }
+
+    static bool equal(const double* one, const double* two) {
+        size_t i = 0;
+#if POINT_SIMD_WIDTH >= 4
+        for (; i + 4 <= N; i += 4) {
+            __m256d same = _mm256_cmp_pd(_mm256_loadu_pd(one + i), _mm256_loadu_pd(two + i), _CMP_EQ_OQ);
+            if (_mm256_movemask_pd(same) != 0xF) return false;
+        }
+#endif
+        for (; i + 2 <= N; i += 2) {
+            __m128d same = _mm_cmpeq_pd(_mm_loadu_pd(one + i), _mm_loadu_pd(two + i));
+            if (_mm_movemask_pd(same) != 0x3) return false;
+        }
+        return i == N || one[i] == two[i];
+    }
+};
+
+// With float coordinates, each step loads half as many bytes as the double
+// kernel does for the same number of coordinates. The terms are added up in
+// the same lanes as there, so float points are exactly as far apart as their
+// copies in double precision, although from four coordinates on the order
+// is not that of the generic loop.
 template <size_t N>
-size_t Point<N>::size() const {
+struct PointKernel<N, float, true> {
+    static double squaredDistance(const float* one, const float* two) {
+        size_t i = 0;
+        __m128d sum2 = _mm_setzero_pd();
+#if POINT_SIMD_WIDTH >= 4
+        if (N >= 4) {
+            __m256d sum4 = _mm256_setzero_pd();
+            for (; i + 4 <= N; i += 4) {
+                __m256d diff = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(one + i)),
+                                             _mm256_cvtps_pd(_mm_loadu_ps(two + i)));
+                sum4 = _mm256_add_pd(sum4, _mm256_mul_pd(diff, diff));
+            }
+            sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4), _mm256_extractf128_pd(sum4, 1));
+        }
+#endif
+        for (; i + 2 <= N; i += 2) {
+            __m128d diff = _mm_sub_pd(_mm_cvtps_pd(loadTwo(one + i)), _mm_cvtps_pd(loadTwo(two + i)));
+            sum2 = _mm_add_pd(sum2, _mm_mul_pd(diff, diff));
+        }
+        double result = _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+        if (i < N) {
+            double diff = double(one[i]) - double(two[i]);
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    static bool equal(const float* one, const float* two) {
+        return std::equal(one, one + N, two);
+    }
+
+    // Loads two floats into the low half of a register
+    static __m128 loadTwo(const float* p) {
+        return _mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    }
+};
+#endif
+
+template <size_t N, typename T>
+size_t Point<N, T>::size() const {
     return N;
 }
 
-template <size_t N>
-double& Point<N>::operator[] (size_t index) {
+template <size_t N, typename T>
+T& Point<N, T>::operator[] (size_t index) {
     return coords[index];
 }
 
-template <size_t N>
-double Point<N>::operator[] (size_t index) const {
+template <size_t N, typename T>
+T Point<N, T>::operator[] (size_t index) const {
     return coords[index];
 }
 
-template <size_t N>
-typename Point<N>::iterator Point<N>::begin() {
+template <size_t N, typename T>
+typename Point<N, T>::iterator Point<N, T>::begin() {
     return coords;
 }
 
-template <size_t N>
-typename Point<N>::const_iterator Point<N>::begin() const {
+template <size_t N, typename T>
+typename Point<N, T>::const_iterator Point<N, T>::begin() const {
     return coords;
 }
 
-template <size_t N>
-typename Point<N>::iterator Point<N>::end() {
+template <size_t N, typename T>
+typename Point<N, T>::iterator Point<N, T>::end() {
     return begin() + size();
 }
 
-template <size_t N>
-typename Point<N>::const_iterator Point<N>::end() const {
+template <size_t N, typename T>
+typename Point<N, T>::const_iterator Point<N, T>::end() const {
     return begin() + size();
 }
 
 // Computing the distance uses the standard distance formula: the square root of
 // the sum of the squares of the differences between matching components.
-template <size_t N>
-double Distance(const Point<N>& one, const Point<N>& two) {
-    double result = 0.0;
-    for (size_t i = 0; i < N; ++i)
-        result += (one[i] - two[i]) * (one[i] - two[i]);
-    
-    return sqrt(result);
+template <size_t N, typename T>
+double Distance(const Point<N, T>& one, const Point<N, T>& two) {
+    return sqrt(SquaredDistance(one, two));
 }
 
-// Equality is implemented using the equal algorithm, which takes in two ranges
-// and reports whether they contain equal values.
-template <size_t N>
-bool operator==(const Point<N>& one, const Point<N>& two) {
-    return std::equal(one.begin(), one.end(), two.begin());
+template <size_t N, typename T>
+double SquaredDistance(const Point<N, T>& one, const Point<N, T>& two) {
+    return PointKernel<N, T>::squaredDistance(one.begin(), two.begin());
 }
 
-template <size_t N>
-bool operator!=(const Point<N>& one, const Point<N>& two) {
+// Equality checks that all matching components are equal, the same way the
+// equal algorithm would over the two ranges.
+template <size_t N, typename T>
+bool operator==(const Point<N, T>& one, const Point<N, T>& two) {
+    return PointKernel<N, T>::equal(one.begin(), two.begin());
+}
+
+template <size_t N, typename T>
+bool operator!=(const Point<N, T>& one, const Point<N, T>& two) {
     return !(one == two);
 }
 
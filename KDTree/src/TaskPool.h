@@ -0,0 +1,331 @@
+/**
+ * File: TaskPool.h
+ * ------------------------
+ * A small work-stealing thread pool for fork-join parallelism.
+ *
+ * Tasks are spawned into a TaskGroup and run on the pool's threads:
+ *
+ * TaskPool pool(8);             // Eight threads in total
+ * TaskGroup group;
+ * pool.spawn(group, someFunction);
+ * pool.spawn(group, otherFunction);
+ * pool.wait(group);             // Both have finished here
+ *
+ * Every thread of the pool owns a deque of tasks. A thread pushes the tasks
+ * it spawns to the back of its own deque and takes work from the back as
+ * well, so recently split work stays hot in its cache. A thread that runs out
+ * of work steals from the front of another thread's deque, where the oldest
+ * (and usually biggest) tasks are.
+ *
+ * The thread that calls wait() runs tasks until the group is done rather than
+ * blocking, so tasks may themselves spawn and wait on subgroups. For that
+ * reason a pool of n threads only starts n - 1 workers: the caller of wait()
+ * is the last one. If a task throws, wait() rethrows the first exception once
+ * every task of the group has finished.
+ *
+ * Tasks often refer to the locals of the function that spawned them. A
+ * TaskGroupWaiter waits on the group when it goes out of scope, so those
+ * locals outlive the tasks even when the function throws:
+ *
+ * TaskGroup group;
+ * TaskGroupWaiter waiter(pool, group);
+ * pool.spawn(group, [&] { work(local); });
+ * mightThrow();
+ * waiter.wait();                // Rethrows the exception of a task
+ */
+
+#ifndef TASK_POOL_INCLUDED
+#define TASK_POOL_INCLUDED
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <exception>
+
+using namespace std;
+
+class TaskPool;
+
+// A set of tasks that can be waited on together.
+class TaskGroup {
+public:
+    TaskGroup() : pending(0) {}
+
+private:
+    atomic<size_t> pending;     // Tasks spawned but not yet finished
+    mutex errorLock;
+    exception_ptr error;        // First exception thrown by a task
+
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+    friend class TaskPool;
+};
+
+class TaskPool {
+public:
+    // Constructor: TaskPool(size_t numThreads = 0);
+    // Usage: TaskPool pool(8);
+    // --------------------------------------------------
+    // Constructs a pool that runs tasks on numThreads threads,
+    // counting the thread that waits on them. Zero means one
+    // thread per hardware thread.
+    explicit TaskPool(size_t numThreads = 0);
+
+    // Destructor: ~TaskPool();
+    // Usage: (implicit)
+    // --------------------------------------------------
+    // Stops and joins the workers. Every group must have been
+    // waited on before the pool is destroyed.
+    ~TaskPool();
+
+    // size_t threadCount() const;
+    // Usage: size_t n = pool.threadCount();
+    // --------------------------------------------------
+    // Returns the number of threads that run tasks.
+    size_t threadCount() const;
+
+    // void spawn(TaskGroup& group, const function<void()>& task);
+    // Usage: pool.spawn(group, [&] { work(); });
+    // --------------------------------------------------
+    // Queues task to run on some thread of the pool as part
+    // of group.
+    void spawn(TaskGroup& group, const function<void()>& task);
+
+    // void wait(TaskGroup& group);
+    // Usage: pool.wait(group);
+    // --------------------------------------------------
+    // Runs queued tasks until every task of group has finished,
+    // then rethrows the first exception one of them threw.
+    void wait(TaskGroup& group);
+
+private:
+    struct Task {
+        function<void()> run;
+        TaskGroup *group;
+    };
+
+    // A deque of tasks owned by one thread
+    struct WorkQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    void shutdown();
+    void workerLoop(size_t self);
+    bool runOne(size_t self);
+    bool popTask(size_t self, Task& task);
+    void execute(Task& task);
+    size_t currentQueue() const;
+
+    vector<WorkQueue*> queues;      // One per thread, the last one is shared by outside threads
+    vector<thread> workers;
+    atomic<size_t> queued;          // Tasks sitting in some queue
+    atomic<bool> stopping;
+    mutex sleepLock;
+    condition_variable wakeUp;
+
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+};
+
+// Waits on a group at the end of a scope.
+class TaskGroupWaiter {
+public:
+    // Constructor: TaskGroupWaiter(TaskPool& pool, TaskGroup& group);
+    // Usage: TaskGroupWaiter waiter(pool, group);
+    // --------------------------------------------------
+    // Makes the destructor wait on group with pool.
+    TaskGroupWaiter(TaskPool& pool, TaskGroup& group);
+
+    // Destructor: ~TaskGroupWaiter();
+    // Usage: (implicit)
+    // --------------------------------------------------
+    // Waits on the group unless wait() already has. An exception
+    // a task threw is dropped here, since the destructor may run
+    // while another exception is on its way out.
+    ~TaskGroupWaiter();
+
+    // void wait();
+    // Usage: waiter.wait();
+    // --------------------------------------------------
+    // Waits on the group now, as TaskPool::wait does.
+    void wait();
+
+private:
+    TaskPool& pool;
+    TaskGroup& group;
+    bool waited;
+
+    TaskGroupWaiter(const TaskGroupWaiter&);
+    TaskGroupWaiter& operator=(const TaskGroupWaiter&);
+};
+
+/** TaskPool class implementation details */
+
+// Index of the queue owned by the worker running on this thread, or of the
+// shared queue for any other thread. Tagged with the pool so that nested
+// pools do not mix up their queues.
+struct TaskPoolThreadInfo {
+    const TaskPool *pool;
+    size_t queue;
+};
+
+inline TaskPoolThreadInfo& currentTaskPoolThread() {
+    static thread_local TaskPoolThreadInfo info = {NULL, 0};
+    return info;
+}
+
+inline TaskPool::TaskPool(size_t numThreads) : queued(0), stopping(false) {
+    if (numThreads == 0) numThreads = thread::hardware_concurrency();
+    if (numThreads == 0) numThreads = 1;
+
+    // numThreads - 1 workers, plus the shared queue used by the waiting thread
+    for (size_t i = 0; i < numThreads; ++i)
+        queues.push_back(new WorkQueue);
+
+    try {
+        for (size_t i = 0; i + 1 < numThreads; ++i)
+            workers.push_back(thread(&TaskPool::workerLoop, this, i));
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+}
+
+inline TaskPool::~TaskPool() {
+    shutdown();
+}
+
+// shutdown stops the workers and frees the queues. It is also
+// used when starting the workers fails half way.
+inline void TaskPool::shutdown() {
+    {
+        lock_guard<mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    workers.clear();
+    for (size_t i = 0; i < queues.size(); ++i)
+        delete queues[i];
+    queues.clear();
+}
+
+inline size_t TaskPool::threadCount() const {
+    return queues.size();
+}
+
+inline size_t TaskPool::currentQueue() const {
+    const TaskPoolThreadInfo& info = currentTaskPoolThread();
+    return info.pool == this ? info.queue : queues.size() - 1;
+}
+
+// spawn counts the task as pending only once it is queued, so a push_back
+// that throws leaves the group as it was. Doing it under the queue lock
+// keeps any thread from taking the task before it is counted.
+inline void TaskPool::spawn(TaskGroup& group, const function<void()>& task) {
+    Task entry = {task, &group};
+
+    WorkQueue *queue = queues[currentQueue()];
+    {
+        lock_guard<mutex> guard(queue->lock);
+        queue->tasks.push_back(entry);
+        group.pending++;
+    }
+    queued++;
+
+    // Taking the lock orders this wake up after a worker that
+    // saw no queued tasks has gone to sleep
+    { lock_guard<mutex> guard(sleepLock); }
+    wakeUp.notify_one();
+}
+
+inline void TaskPool::wait(TaskGroup& group) {
+    size_t self = currentQueue();
+    while (group.pending != 0) {
+        if (!runOne(self)) this_thread::yield();
+    }
+
+    if (group.error) {
+        exception_ptr error = group.error;
+        group.error = exception_ptr();
+        rethrow_exception(error);
+    }
+}
+
+inline TaskGroupWaiter::TaskGroupWaiter(TaskPool& pool, TaskGroup& group)
+    : pool(pool), group(group), waited(false) {}
+
+inline TaskGroupWaiter::~TaskGroupWaiter() {
+    if (waited) return;
+    try {
+        pool.wait(group);
+    } catch (...) {
+    }
+}
+
+inline void TaskGroupWaiter::wait() {
+    waited = true;
+    pool.wait(group);
+}
+
+// popTask takes the newest task of the thread's own queue, or steals
+// the oldest task of some other queue.
+inline bool TaskPool::popTask(size_t self, Task& task) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+        size_t victim = (self + i) % queues.size();
+        WorkQueue *queue = queues[victim];
+        lock_guard<mutex> guard(queue->lock);
+        if (queue->tasks.empty()) continue;
+
+        if (i == 0) {
+            task = queue->tasks.back();
+            queue->tasks.pop_back();
+        } else {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+inline bool TaskPool::runOne(size_t self) {
+    Task task;
+    if (!popTask(self, task)) return false;
+    execute(task);
+    return true;
+}
+
+inline void TaskPool::execute(Task& task) {
+    try {
+        task.run();
+    } catch (...) {
+        lock_guard<mutex> guard(task.group->errorLock);
+        if (!task.group->error) task.group->error = current_exception();
+    }
+    task.group->pending--;
+}
+
+inline void TaskPool::workerLoop(size_t self) {
+    TaskPoolThreadInfo& info = currentTaskPoolThread();
+    info.pool = this;
+    info.queue = self;
+
+    while (true) {
+        if (runOne(self)) continue;
+
+        unique_lock<mutex> guard(sleepLock);
+        wakeUp.wait(guard, [this] { return stopping || queued != 0; });
+        if (stopping) return;
+    }
+}
+
+#endif // TASK_POOL_INCLUDED
@@ -14,12 +14,24 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <vector>
 #include <iomanip>
 #include <cstdarg>
 #include <set>
 #include <list>
+#include <iterator>
+#include <memory>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 #include "KDTree.h"
+#include "DynamicKDTree.h"
+#include "MappedKDTree.h"
+#include "FrozenKDTree.h"
+#include "BoundedPQueue.h"
 using namespace std;
 
 /* These flags control which tests will be run.  Initially, only the
@@ -37,11 +49,37 @@ using namespace std;
 
 #define NearestNeighborTestEnabled      1 // Step two checks
 #define MoreNearestNeighborTestEnabled  1
+#define BatchNearestNeighborTestEnabled 1
+#define ApproximateNeighborTestEnabled  1
+#define BestBinFirstTestEnabled         1
+
+#define RangeQueryTestEnabled           1 // Range query checks
+#define RadiusSearchTestEnabled         1
 
 #define BasicCopyTestEnabled            1 // Step three checks
 #define ModerateCopyTestEnabled         1
+#define AllocatorTestEnabled            1
+#define MoveTestEnabled                 1
+#define EraseTestEnabled                1
+#define SortedInsertTestEnabled         1
 
 #define BunchConstrucEnabled            1 // Step four checks
+#define ParallelBuildTestEnabled        1
+#define DynamicKDTreeTestEnabled        1
+#ifndef _WIN32
+#define MappedKDTreeTestEnabled         1
+#else
+#define MappedKDTreeTestEnabled         0 // MappedKDTree is POSIX-only
+#endif
+#define CoordinateTypeTestEnabled       1
+#define LeafBucketTestEnabled           1
+#define SplitRuleTestEnabled            1
+#define BoundingBoxTestEnabled          1
+#define QueryContextTestEnabled         1
+#define PayloadCopyTestEnabled          1
+#define FrozenKDTreeTestEnabled         1
+#define SmallDimensionTestEnabled       1
+#define BoundedPQueueTestEnabled        1
 
 /* A utility function to construct a Point from a range of iterators. */
 template <size_t N, typename IteratorType>
@@ -627,6 +665,21 @@ void MoreNearestNeighborTest() try {
    */
   CheckCondition(kd.kNNValue(MakePoint(-10.0, -10.0), 25) == 'b', "No problems with looking up more neighbors than elements.");
 
+  /* The neighbors themselves: the center and its four closest points, nearest first. */
+  vector<KDNeighbor<2, char> > neighbors;
+  CheckCondition(kd.kNearest(MakePoint(0.5, 0.5), 5, neighbors) == 5 && neighbors.size() == 5, "Found five neighbors.");
+  CheckCondition(neighbors[0].point == MakePoint(0.5, 0.5) && neighbors[0].value == 'a' && neighbors[0].distance == 0,
+                 "Nearest neighbor is the point itself.");
+  bool ringCorrect = true;
+  for (size_t i = 1; i < 5; ++i)
+    ringCorrect = ringCorrect && neighbors[i].distance == 0.5 && Distance(neighbors[i].point, MakePoint(0.5, 0.5)) == 0.5;
+  CheckCondition(ringCorrect, "Next neighbors are the four points at distance 0.5.");
+
+  /* Reusing the buffer with a smaller k shrinks it. */
+  CheckCondition(kd.kNearest(MakePoint(10.0, 10.0), 2, neighbors) == 2 && neighbors.size() == 2 &&
+                 neighbors[0].point == MakePoint(1.0, 1.0), "Buffer is reused for the next query.");
+  CheckCondition(kd.kNearest(MakePoint(10.0, 10.0), 25, neighbors) == 9, "Returns every point when k is too large.");
+
   EndTest();
 #else
   TestDisabled("MoreNearestNeighborTest");
@@ -635,6 +688,335 @@ void MoreNearestNeighborTest() try {
   FailTest(e);
 }
 
+/* Checks that the batched queries give exactly the answers of one query
+ * at a time, whatever the number of threads.
+ */
+void BatchNearestNeighborTest() try {
+#if BatchNearestNeighborTestEnabled
+  PrintBanner("Batch Nearest Neighbor Test");
+
+  /* Labels on a 30x30 grid, in stripes so that k-NN votes are interesting. */
+  KDTree<2, char> kd;
+  for (int x = 0; x < 30; ++x)
+    for (int y = 0; y < 30; ++y)
+      kd.insert(MakePoint(x, y), "abc"[(x / 3 + y / 5) % 3]);
+
+  vector<Point<2> > queries;
+  for (int i = 0; i < 1000; ++i)
+    queries.push_back(MakePoint((i * 17) % 31 - 0.3, (i * 29) % 33 + 0.45));
+
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    vector<char> labels = kd.kNNValueBatch(queries, 7, threads);
+    bool same = labels.size() == queries.size();
+    for (size_t i = 0; same && i < queries.size(); ++i)
+      same = labels[i] == kd.kNNValue(queries[i], 7);
+    CheckCondition(same, "Batched k-NN values match single queries.");
+  }
+
+  vector<KDNeighbor<2, char> > neighbors;
+  size_t stride = kd.kNearestBatch(queries, 4, neighbors, 4);
+  CheckCondition(stride == 4 && neighbors.size() == 4 * queries.size(), "One run of neighbors per query.");
+
+  bool sorted = true, correct = true;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    for (size_t j = 0; j < stride; ++j) {
+      const KDNeighbor<2, char>& n = neighbors[i * stride + j];
+      correct = correct && kd.at(n.point) == n.value && n.distance == Distance(n.point, queries[i]);
+      if (j > 0) sorted = sorted && neighbors[i * stride + j - 1].distance <= n.distance;
+    }
+  }
+  CheckCondition(correct, "Batched neighbors carry their value and distance.");
+  CheckCondition(sorted, "Batched neighbors are sorted by distance.");
+
+  /* Searches cut short fill the rest of their row with infinite distances. */
+  KDSearchOptions oneCheck(0, 1), nearby;
+  nearby.maxDistance = 1.5;
+  for (int pass = 0; pass < 2; ++pass) {
+    const KDSearchOptions& options = pass == 0 ? oneCheck : nearby;
+    stride = kd.kNearestBatch(queries, 8, neighbors, 4, options);
+    bool rowsOk = stride == 8 && neighbors.size() == 8 * queries.size(), someShort = false;
+    vector<KDNeighbor<2, char> > single;
+    for (size_t i = 0; rowsOk && i < queries.size(); ++i) {
+      size_t found = kd.kNearest(queries[i], 8, single, options);
+      someShort = someShort || found < stride;
+      for (size_t j = 0; j < found; ++j) {
+        const KDNeighbor<2, char>& n = neighbors[i * stride + j];
+        rowsOk = rowsOk && n.point == single[j].point && n.value == single[j].value && n.distance == single[j].distance;
+      }
+      for (size_t j = found; j < stride; ++j)
+        rowsOk = rowsOk && neighbors[i * stride + j].distance == numeric_limits<double>::infinity();
+    }
+    CheckCondition(rowsOk && someShort, pass == 0 ? "Rows of a batch with maxChecks = 1 end in unused slots."
+                                                  : "Rows of a batch with maxDistance end in unused slots.");
+  }
+
+  /* Asking for more neighbors than there are points. */
+  KDTree<2, char> small;
+  small[MakePoint(0, 0)] = 'x';
+  small[MakePoint(1, 1)] = 'y';
+  CheckCondition(small.kNearestBatch(queries, 5, neighbors) == 2 && neighbors.size() == 2 * queries.size(),
+                 "Batch returns every point when k is larger than the tree.");
+
+  /* Nothing to find: k of zero, or an empty tree. */
+  KDTree<2, char> empty;
+  CheckCondition(kd.kNearestBatch(queries, 0, neighbors, 4) == 0 && neighbors.empty(),
+                 "Batch with k = 0 finds nothing.");
+  CheckCondition(empty.kNearestBatch(queries, 3, neighbors, 4) == 0 && neighbors.empty(),
+                 "Batch on an empty tree finds nothing.");
+
+  EndTest();
+#else
+  TestDisabled("BatchNearestNeighborTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks box range queries against a brute-force scan. */
+void RangeQueryTest() try {
+#if RangeQueryTestEnabled
+  PrintBanner("Range Query Test");
+
+  /* Points on a grid with some repeated coordinates, built both ways. */
+  vector<pair<Point<3>, int> > values;
+  for (int i = 0; i < 500; ++i)
+    values.push_back(make_pair(MakePoint((i * 7) % 13, (i * 11) % 17, (i * 3) % 10), i));
+
+  KDTree<3, int> built(values.begin(), values.end());
+  KDTree<3, int> inserted;
+  for (size_t i = 0; i < values.size(); ++i)
+    inserted.insert(values[i].first, values[i].second);
+
+  const double boxes[][6] = {
+    {2, 3, 1, 8, 9, 6},        // A box inside the data
+    {4, 4, 4, 4, 4, 4},        // A single point, boundaries included
+    {-5, -5, -5, 100, 100, 100}, // Everything
+    {20, 0, 0, 30, 5, 5},      // Nothing
+    {6, 0, 9, 6, 16, 9}        // A flat slab
+  };
+
+  for (size_t b = 0; b < sizeof(boxes) / sizeof(boxes[0]); ++b) {
+    Point<3> lo = PointFromRange<3>(boxes[b], boxes[b] + 3);
+    Point<3> hi = PointFromRange<3>(boxes[b] + 3, boxes[b] + 6);
+
+    set<int> expected;
+    for (size_t i = 0; i < values.size(); ++i) {
+      bool inside = true;
+      for (size_t d = 0; d < 3; ++d)
+        inside = inside && lo[d] <= values[i].first[d] && values[i].first[d] <= hi[d];
+      if (inside) expected.insert(values[i].second);
+    }
+
+    vector<pair<Point<3>, int> > found;
+    built.rangeQuery(lo, hi, back_inserter(found));
+    set<int> foundValues;
+    for (size_t i = 0; i < found.size(); ++i)
+      foundValues.insert(found[i].second);
+
+    CheckCondition(found.size() == expected.size() && foundValues == expected, "Range query finds exactly the points in the box.");
+    CheckCondition(built.rangeCount(lo, hi) == expected.size(), "Range count matches the brute-force count.");
+    CheckCondition(inserted.rangeCount(lo, hi) == expected.size(), "Range count works on a tree built by insertion.");
+  }
+
+  KDTree<3, int> empty;
+  CheckCondition(empty.rangeCount(MakePoint(0, 0, 0), MakePoint(1, 1, 1)) == 0, "Empty tree has nothing in range.");
+
+  EndTest();
+#else
+  TestDisabled("RangeQueryTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks fixed-radius searches against a brute-force scan. */
+void RadiusSearchTest() try {
+#if RadiusSearchTestEnabled
+  PrintBanner("Radius Search Test");
+
+  /* A 15x15 integer grid, so plenty of points sit exactly on the radius. */
+  KDTree<2, int> kd;
+  for (int x = 0; x < 15; ++x)
+    for (int y = 0; y < 15; ++y)
+      kd[MakePoint(x, y)] = 15 * x + y;
+
+  const double queries[][3] = {
+    {7, 7, 2},      // Centered on a point, radius 2 includes (7, 9) etc.
+    {3.5, 2.5, 1.5},
+    {0, 0, 0},      // Only the point itself
+    {-3, 7, 3},     // Ball poking in from outside
+    {7, 7, 30},     // Everything
+    {50, 50, 1}     // Nothing
+  };
+
+  for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+    Point<2> key = MakePoint(queries[q][0], queries[q][1]);
+    double radius = queries[q][2];
+
+    set<int> expected;
+    for (int x = 0; x < 15; ++x)
+      for (int y = 0; y < 15; ++y)
+        if (Distance(MakePoint(x, y), key) <= radius) expected.insert(15 * x + y);
+
+    vector<KDNeighbor<2, int> > found;
+    kd.radiusSearch(key, radius, back_inserter(found));
+    set<int> foundValues;
+    bool distancesRight = true;
+    for (size_t i = 0; i < found.size(); ++i) {
+      foundValues.insert(found[i].value);
+      distancesRight = distancesRight && found[i].distance == Distance(found[i].point, key);
+    }
+    CheckCondition(found.size() == expected.size() && foundValues == expected, "Radius search finds exactly the points in the ball.");
+    CheckCondition(distancesRight, "Radius search reports correct distances.");
+
+    /* The bounded version stops early with points from the same ball. */
+    vector<KDNeighbor<2, int> > some;
+    kd.radiusSearch(key, radius, back_inserter(some), 3);
+    bool subset = some.size() == min<size_t>(3, expected.size());
+    for (size_t i = 0; i < some.size(); ++i)
+      subset = subset && expected.count(some[i].value);
+    CheckCondition(subset, "Bounded radius search returns at most maxResults points of the ball.");
+  }
+
+  /* On the boundary the distance reported decides, however its square
+   * rounds. (57.625, 60.5) is one of the points whose squared distance from
+   * the origin rounds above the square of the distance reported for it.
+   */
+  vector<Point<2> > edgePoints(1, MakePoint(57.625, 60.5));
+  for (int i = 1; i < 300; ++i)
+    edgePoints.push_back(MakePoint((i * 389) % 1000 / 8.0, (i * 577) % 1000 / 8.0));
+  KDTree<2, int> edge;
+  for (size_t i = 0; i < edgePoints.size(); ++i)
+    edge[edgePoints[i]] = int(i);
+  bool boundaryOk = true;
+  for (size_t p = 0; p < edgePoints.size(); ++p) {
+    double radius = Distance(edgePoints[p], MakePoint(0, 0));
+    for (int pass = 0; pass < 2; ++pass) {
+      vector<KDNeighbor<2, int> > found;
+      edge.radiusSearch(MakePoint(0, 0), radius, back_inserter(found));
+      bool hasPoint = false;
+      for (size_t i = 0; i < found.size(); ++i) {
+        boundaryOk = boundaryOk && found[i].distance <= radius;
+        hasPoint = hasPoint || found[i].value == int(p);
+      }
+      boundaryOk = boundaryOk && hasPoint == (pass == 0);
+      radius = nextafter(radius, 0.0);
+    }
+  }
+  CheckCondition(boundaryOk, "A point is in the ball exactly when its reported distance is at most the radius.");
+
+  EndTest();
+#else
+  TestDisabled("RadiusSearchTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that approximate searches stay within their error bound, and that
+ * epsilon = 0 is the exact search.
+ */
+void ApproximateNeighborTest() try {
+#if ApproximateNeighborTestEnabled
+  PrintBanner("Approximate Nearest Neighbor Test");
+
+  /* Scattered points in 4-D from a simple deterministic generator. */
+  vector<pair<Point<4>, int> > values;
+  unsigned seed = 12345;
+  for (int i = 0; i < 3000; ++i) {
+    Point<4> pt;
+    for (size_t d = 0; d < 4; ++d) {
+      seed = seed * 1103515245 + 12345;
+      pt[d] = (seed >> 8) % 10000 / 100.0;
+    }
+    values.push_back(make_pair(pt, i % 5));
+  }
+  KDTree<4, int> kd(values.begin(), values.end());
+
+  const double epsilon = 0.5;
+  bool exactMatches = true, withinBound = true;
+  vector<KDNeighbor<4, int> > exact, approx, zero;
+  for (int q = 0; q < 200; ++q) {
+    Point<4> key = values[(q * 37) % values.size()].first;
+    key[q % 4] += 1.7;
+
+    kd.kNearest(key, 6, exact);
+    kd.kNearest(key, 6, zero, KDSearchOptions(0));
+    kd.kNearest(key, 6, approx, KDSearchOptions(epsilon));
+
+    for (size_t i = 0; i < exact.size(); ++i) {
+      exactMatches = exactMatches && zero[i].point == exact[i].point;
+      withinBound = withinBound && approx[i].distance <= (1 + epsilon) * exact[i].distance + 1e-12;
+    }
+    exactMatches = exactMatches && kd.kNNValue(key, 6, KDSearchOptions(0)) == kd.kNNValue(key, 6);
+  }
+  CheckCondition(exactMatches, "Epsilon of zero gives the exact neighbors.");
+  CheckCondition(withinBound, "Approximate neighbors are within (1 + epsilon) of the exact ones.");
+
+  EndTest();
+#else
+  TestDisabled("ApproximateNeighborTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks best-bin-first searches, with and without a budget of checks. */
+void BestBinFirstTest() try {
+#if BestBinFirstTestEnabled
+  PrintBanner("Best Bin First Test");
+
+  /* A 40x40 grid with labels in diagonal stripes, built by insertion. */
+  KDTree<2, int> kd;
+  for (int x = 0; x < 40; ++x)
+    for (int y = 0; y < 40; ++y)
+      kd.insert(MakePoint((x * 13) % 40, (y * 7) % 40 + 0.1 * x), (x + y) % 4);
+
+  KDSearchOptions unlimited;
+  unlimited.bestBinFirst = true;
+
+  bool exact = true, budgetRespected = true, budgetedValid = true;
+  vector<KDNeighbor<2, int> > dfs, bbf, limited;
+  for (int q = 0; q < 150; ++q) {
+    Point<2> key = MakePoint((q * 17) % 45 - 2.5, (q * 23) % 43 - 1.25);
+
+    /* Without a budget best-bin-first is exact. The grid has many points at
+     * equal distances, and the two orders of search may keep different ones
+     * of those, so only the distances are compared.
+     */
+    kd.kNearest(key, 5, dfs);
+    kd.kNearest(key, 5, bbf, unlimited);
+    for (size_t i = 0; i < dfs.size(); ++i)
+      exact = exact && bbf[i].distance == dfs[i].distance;
+
+    /* A budget smaller than k only leaves room for that many points. */
+    budgetRespected = budgetRespected && kd.kNearest(key, 5, limited, KDSearchOptions(0, 3)) == 3;
+
+    /* With a larger budget the results are real points, sorted, and no
+     * closer than the exact answer.
+     */
+    kd.kNearest(key, 5, limited, KDSearchOptions(0, 20));
+    for (size_t i = 0; i < limited.size(); ++i) {
+      budgetedValid = budgetedValid && kd.contains(limited[i].point) &&
+                      limited[i].distance == Distance(limited[i].point, key) &&
+                      limited[i].distance >= dfs[i].distance;
+      if (i > 0) budgetedValid = budgetedValid && limited[i - 1].distance <= limited[i].distance;
+    }
+  }
+  CheckCondition(exact, "Unlimited best-bin-first search matches the exact search.");
+  CheckCondition(budgetRespected, "Search stops after maxChecks points.");
+  CheckCondition(budgetedValid, "Budgeted search returns valid neighbors in order.");
+
+  /* Even a budget of one examines the root and returns it. */
+  CheckCondition(kd.kNearest(MakePoint(20, 20), 1, limited, KDSearchOptions(0, 1)) == 1, "Budget of one returns a point.");
+
+  EndTest();
+#else
+  TestDisabled("BestBinFirstTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
 
 void BunchConstructTest() try {
 #if BunchConstrucEnabled
@@ -654,14 +1036,133 @@ void BunchConstructTest() try {
     KDTree<2, int> tree(values.begin(), values.end());
     CheckCondition(tree.size() == 7, "Bunch data all elements inserted.");
 
+    /* Every point should be found with its own value. */
+    for (size_t i = 0; i < values.size(); ++i)
+      CheckCondition(tree.at(values[i].first) == values[i].second, "Bunch data element has correct value.");
+    CheckCondition(!tree.contains(MakePoint(2.0, 1.0)), "Bunch data has no extra elements.");
+
+    /* Lots of equal keys in both dimensions: the median has to be moved to the
+     * first of its equal keys, or lookups that go right on equality get lost.
+     */
+    vector<pair<Point<2>, int> > grid;
+    for (int x = 0; x < 5; ++x)
+      for (int y = 0; y < 7; ++y)
+        grid.push_back(make_pair(MakePoint(x % 3, y % 4 + 10 * x), 7 * x + y));
+
+    KDTree<2, int> gridTree(grid.begin(), grid.end());
+    CheckCondition(gridTree.size() == grid.size(), "Duplicate keys all inserted.");
+    bool allFound = true;
+    for (size_t i = 0; i < grid.size(); ++i)
+      allFound = allFound && gridTree.contains(grid[i].first);
+    CheckCondition(allFound, "Points with duplicate keys are all found.");
+
+    EndTest();
+#else
+    TestDisabled("BunchConstructTest");
+#endif
+} catch (const exception& e) {
+    FailTest(e);
+}
+
+/* Reads a whole file into a string, for comparing saved trees byte by byte. */
+string ReadFileBytes(const string& filename) {
+  ifstream in(filename.c_str(), ios::binary);
+  return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
 
+/* A label whose copy throws once a set number of copies have been made, to
+ * check that a tree gives up cleanly when its ElemType throws. Copies happen
+ * on build and merge threads, so the count is atomic.
+ */
+struct ThrowingLabel {
+  static atomic<long> copiesLeft;   // Copies allowed before one throws, or -1 for no limit
+  int id;
+
+  ThrowingLabel(int id = 0) : id(id) {}
+  ThrowingLabel(const ThrowingLabel& rhs) : id(rhs.id) { countCopy(); }
+  ThrowingLabel& operator=(const ThrowingLabel& rhs) {
+    countCopy();
+    id = rhs.id;
+    return *this;
+  }
+  static void countCopy() {
+    if (copiesLeft.fetch_sub(1) == 0) throw runtime_error("ThrowingLabel copy failed");
+  }
+};
 
+atomic<long> ThrowingLabel::copiesLeft(-1);
 
+/* Checks that building a tree on several threads gives the same tree as
+ * building it on one.
+ */
+void ParallelBuildTest() try {
+#if ParallelBuildTestEnabled
+    PrintBanner("Parallel Build Test");
+
+    /* A 20x20x20 lattice with a couple of repeated coordinates per axis. */
+    vector<pair<Point<3>, int> > values;
+    for (int x = 0; x < 20; ++x)
+      for (int y = 0; y < 20; ++y)
+        for (int z = 0; z < 20; ++z)
+          values.push_back(make_pair(MakePoint(x / 2, (y * 7) % 20, z), x + y + z));
+
+    /* Tiny cutoff so that plenty of tasks get spawned. */
+    KDTree<3, int> serial(values.begin(), values.end());
+    KDTree<3, int> parallel(values.begin(), values.end(), KDBuildOptions(4, 16));
+    CheckCondition(parallel.size() == serial.size(), "Parallel build has every element.");
+
+    bool allFound = true;
+    for (size_t i = 0; i < values.size(); ++i)
+      allFound = allFound && parallel.contains(values[i].first);
+    CheckCondition(allFound, "Parallel build contains every point.");
+
+    bool sameAnswers = true;
+    for (int i = 0; i < 200; ++i) {
+      Point<3> key = MakePoint((i * 37) % 23 - 1.5, (i * 11) % 21 + 0.25, (i * 5) % 19);
+      sameAnswers = sameAnswers && serial.kNNValue(key, 5) == parallel.kNNValue(key, 5);
+    }
+    CheckCondition(sameAnswers, "Parallel and serial builds agree on nearest neighbors.");
+
+#ifndef _WIN32
+    /* Saved trees hold every node array, so equal files mean equal shapes. */
+    const string serialFile = "parallel-build-serial.kdt", parallelFile = "parallel-build-parallel.kdt";
+    MappedKDTree<3, int>::save(serial, serialFile);
+    MappedKDTree<3, int>::save(parallel, parallelFile);
+    string serialBytes = ReadFileBytes(serialFile);
+    CheckCondition(!serialBytes.empty() && serialBytes == ReadFileBytes(parallelFile),
+                   "Parallel and serial builds give the same tree.");
+    remove(serialFile.c_str());
+    remove(parallelFile.c_str());
+#endif
 
+    /* A copy that throws part way through the build must reach the caller
+     * only once every task that refers to the build's locals has finished.
+     */
+    vector<pair<Point<3>, ThrowingLabel> > labeled;
+    for (size_t i = 0; i < values.size(); ++i)
+      labeled.push_back(make_pair(values[i].first, ThrowingLabel(values[i].second)));
+    bool allThrew = true;
+    for (long copies = 40000; copies <= 200000; copies += 40000) {
+      ThrowingLabel::copiesLeft = copies;
+      bool threw = false;
+      try {
+        KDTree<3, ThrowingLabel> failed(labeled.begin(), labeled.end(), KDBuildOptions(4, 16));
+      } catch (const runtime_error&) {
+        threw = true;
+      }
+      allThrew = allThrew && threw;
+    }
+    ThrowingLabel::copiesLeft = -1;
+    CheckCondition(allThrew, "A parallel build passes on an exception thrown by a copy.");
 
+    KDTree<3, int> oneThread(values.begin(), values.end(), KDBuildOptions(1));
+    KDTree<3, int> allThreads(values.begin(), values.end(), KDBuildOptions(0, 64));
+    CheckCondition(oneThread.size() == values.size() && allThreads.size() == values.size(),
+                   "Any thread count builds the whole tree.");
 
+    EndTest();
 #else
-    TestDisabled("BunchConstructTest");
+    TestDisabled("ParallelBuildTest");
 #endif
 } catch (const exception& e) {
     FailTest(e);
@@ -780,6 +1281,1351 @@ void ModerateCopyTest() try {
   FailTest(e);
 }
 
+/* An allocator that counts the blocks allocated through it and not yet
+ * returned, standing in for an arena that the nodes of a tree are carved
+ * from.
+ */
+template <typename T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  size_t *live;
+
+  explicit CountingAllocator(size_t *counter) : live(counter) {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>& other) : live(other.live) {}
+
+  T* allocate(size_t n) {
+    ++*live;
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t) {
+    --*live;
+    ::operator delete(p);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs) {
+  return lhs.live == rhs.live;
+}
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+/* Checks that the nodes of a tree come from its allocator. */
+void AllocatorTest() try {
+#if AllocatorTestEnabled
+  PrintBanner("Allocator Test");
+
+  typedef KDTree<2, size_t, CountingAllocator<size_t> > CountingTree;
+  size_t live = 0, otherLive = 0;
+  CountingAllocator<size_t> alloc(&live);
+
+  {
+    CountingTree kd(alloc);
+    kd.reserve(100);
+    size_t arrays = live;
+    CheckCondition(arrays != 0, "Reserving allocates from the allocator.");
+
+    for (size_t i = 0; i < 100; ++i)
+      kd[MakePoint(i % 10, i / 10)] = i;
+    CheckCondition(live == arrays, "Inserting into reserved room leaves only the node arrays allocated.");
+    CheckCondition(kd.size() == 100, "All reserved nodes were inserted.");
+
+    /* Copies allocate one block per array from the same allocator. */
+    CountingTree clone(kd);
+    CheckCondition(live == 2 * arrays, "Copying allocates each node array once.");
+    CheckCondition(clone.get_allocator() == alloc, "Copies use the same allocator.");
+
+    CountingTree other((CountingAllocator<size_t>(&otherLive)));
+    other = kd;
+    CheckCondition(otherLive == arrays && live == 2 * arrays, "Assignment allocates from the assigned tree's allocator.");
+
+    bool allFound = true;
+    for (size_t i = 0; i < 100; ++i)
+      allFound = allFound && other.at(MakePoint(i % 10, i / 10)) == i && clone.kNNValue(MakePoint(i % 10, i / 10), 1) == i;
+    CheckCondition(allFound, "Copied trees hold every element.");
+  }
+  CheckCondition(live == 0 && otherLive == 0, "Every node array is given back to its allocator.");
+
+  EndTest();
+#else
+  TestDisabled("AllocatorTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks moving trees around and moving values into them. */
+void MoveTest() try {
+#if MoveTestEnabled
+  PrintBanner("Move Test");
+
+  /* Values that can only be moved go into the tree without copies. */
+  KDTree<2, unique_ptr<int> > owners;
+  owners.insert(MakePoint(0, 0), unique_ptr<int>(new int(0)));
+  owners.emplace(MakePoint(1, 1), new int(1));
+  unique_ptr<int> two(new int(2));
+  owners.insert(MakePoint(2, 2), std::move(two));
+  CheckCondition(owners.size() == 3 && !two, "Values are moved into the tree.");
+
+  owners.emplace(MakePoint(1, 1), new int(10));
+  CheckCondition(owners.size() == 3 && *owners.at(MakePoint(1, 1)) == 10, "Emplacing an existing point replaces its value.");
+
+  /* Moving the tree hands over every node and leaves the source empty. */
+  KDTree<2, unique_ptr<int> > moved(std::move(owners));
+  CheckCondition(moved.size() == 3 && owners.empty(), "Move constructor steals the nodes.");
+  CheckCondition(*moved.at(MakePoint(2, 2)) == 2, "Moved tree keeps its values.");
+
+  owners = std::move(moved);
+  CheckCondition(owners.size() == 3 && moved.empty(), "Move assignment steals the nodes.");
+  CheckCondition(*owners.at(MakePoint(0, 0)) == 0, "Move assigned tree keeps its values.");
+
+  /* A moved-from tree can be used again. */
+  moved.emplace(MakePoint(5, 5), new int(5));
+  CheckCondition(moved.size() == 1 && *moved.at(MakePoint(5, 5)) == 5, "Moved-from tree is usable.");
+
+  /* Building from move iterators moves the values out of the input. */
+  vector<pair<Point<2>, string> > values;
+  for (size_t i = 0; i < 20; ++i)
+    values.push_back(make_pair(MakePoint(i, i % 3), string(40, char('a' + i))));
+  KDTree<2, string> kd(make_move_iterator(values.begin()), make_move_iterator(values.end()));
+
+  bool allMoved = true, allFound = true;
+  for (size_t i = 0; i < 20; ++i) {
+    allMoved = allMoved && values[i].second.empty();
+    allFound = allFound && kd.at(MakePoint(i, i % 3)) == string(40, char('a' + i));
+  }
+  CheckCondition(allMoved, "Range constructor moves from move iterators.");
+  CheckCondition(allFound, "Tree built from move iterators holds every value.");
+
+  EndTest();
+#else
+  TestDisabled("MoveTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Orders points lexicographically, so they can be kept in a map. */
+struct PointLess {
+  template <size_t N>
+  bool operator()(const Point<N>& lhs, const Point<N>& rhs) const {
+    return lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+  }
+};
+
+/* Checks erasing points against a brute-force copy of the tree's contents,
+ * through enough erasures that subtrees get rebuilt.
+ */
+void EraseTest() try {
+#if EraseTestEnabled
+  PrintBanner("Erase Test");
+
+  /* Scattered points in 3-D from a simple deterministic generator. */
+  vector<Point<3> > pts;
+  unsigned seed = 4242;
+  for (size_t i = 0; i < 2000; ++i) {
+    Point<3> pt;
+    for (size_t d = 0; d < 3; ++d) {
+      seed = seed * 1103515245 + 12345;
+      pt[d] = (seed >> 8) % 1000 / 10.0;
+    }
+    pts.push_back(pt);
+  }
+
+  vector<pair<Point<3>, size_t> > values;
+  for (size_t i = 0; i < pts.size(); ++i)
+    values.push_back(make_pair(pts[i], i));
+  KDTree<3, size_t> kd(values.begin(), values.end());
+
+  /* Points generated twice keep the value of the last copy. */
+  map<Point<3>, size_t, PointLess> present;
+  for (size_t i = 0; i < pts.size(); ++i)
+    present[pts[i]] = i;
+  CheckCondition(kd.size() == present.size(), "Tree holds every distinct point.");
+
+  CheckCondition(!kd.erase(MakePoint(-1, -1, -1)), "Erasing a missing point returns false.");
+
+  bool erasedOk = true, lookupsOk = true, nearestOk = true, rangeOk = true;
+  vector<KDNeighbor<3, size_t> > found;
+  for (size_t round = 0; round < 9; ++round) {
+    /* Erase a tenth of the original points per round, each twice. */
+    for (size_t i = round; i < pts.size(); i += 9) {
+      bool wasThere = present.erase(pts[i]) != 0;
+      erasedOk = erasedOk && kd.erase(pts[i]) == wasThere && !kd.erase(pts[i]);
+    }
+    erasedOk = erasedOk && kd.size() == present.size();
+
+    for (size_t i = 0; i < pts.size(); i += 7) {
+      bool there = present.count(pts[i]) != 0;
+      lookupsOk = lookupsOk && kd.contains(pts[i]) == there;
+      if (there) {
+        lookupsOk = lookupsOk && kd.at(pts[i]) == present[pts[i]];
+      } else {
+        try {
+          kd.at(pts[i]);
+          lookupsOk = false;
+        } catch (const out_of_range&) {}
+      }
+    }
+
+    for (size_t q = 0; q < 20 && !present.empty(); ++q) {
+      Point<3> key = MakePoint(q * 5.3, 100 - q * 4.1, (q * 37) % 100);
+
+      /* The exact distances of the 4 nearest points still in the tree. */
+      vector<double> expected;
+      for (map<Point<3>, size_t, PointLess>::iterator itr = present.begin(); itr != present.end(); ++itr)
+        expected.push_back(Distance(itr->first, key));
+      sort(expected.begin(), expected.end());
+      expected.resize(min<size_t>(4, expected.size()));
+
+      kd.kNearest(key, 4, found);
+      nearestOk = nearestOk && found.size() == expected.size();
+      for (size_t i = 0; i < found.size() && i < expected.size(); ++i)
+        nearestOk = nearestOk && found[i].distance == expected[i] && present.count(found[i].point) != 0;
+
+      Point<3> lo = MakePoint(q * 4, q * 3, 10), hi = MakePoint(q * 4 + 30, q * 3 + 40, 70);
+      size_t inside = 0;
+      for (map<Point<3>, size_t, PointLess>::iterator itr = present.begin(); itr != present.end(); ++itr) {
+        bool in = true;
+        for (size_t d = 0; d < 3; ++d)
+          in = in && lo[d] <= itr->first[d] && itr->first[d] <= hi[d];
+        inside += in;
+      }
+      rangeOk = rangeOk && kd.rangeCount(lo, hi) == inside;
+    }
+  }
+  CheckCondition(erasedOk, "Erase reports which points were there and updates the size.");
+  CheckCondition(lookupsOk, "Erased points are gone and the rest are still found.");
+  CheckCondition(nearestOk, "Nearest neighbor searches skip erased points.");
+  CheckCondition(rangeOk, "Range queries skip erased points.");
+
+  /* Erased points can come back, and the tree can be emptied. */
+  bool reinsertOk = true;
+  for (size_t i = 0; i < pts.size(); i += 3) {
+    kd.insert(pts[i], i);
+    reinsertOk = reinsertOk && kd.contains(pts[i]) && kd.at(pts[i]) == i;
+  }
+  CheckCondition(reinsertOk, "Erased points can be inserted again.");
+
+  for (size_t i = 0; i < pts.size(); ++i)
+    kd.erase(pts[i]);
+  CheckCondition(kd.empty() && kd.kNNValue(pts[0], 3) == 0, "Erasing every point empties the tree.");
+
+  kd[pts[5]] = 5;
+  CheckCondition(kd.size() == 1 && kd.kNNValue(pts[0], 3) == 5, "An emptied tree can be filled again.");
+
+  EndTest();
+#else
+  TestDisabled("EraseTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks trees grown from points that arrive in sorted order, or that all
+ * share a coordinate, which keep getting rebalanced as they grow.
+ */
+void SortedInsertTest() try {
+#if SortedInsertTestEnabled
+  PrintBanner("Sorted Insert Test");
+
+  /* Points along a diagonal, in order, and points on the plane x = 3. */
+  vector<Point<3> > pts;
+  for (size_t i = 0; i < 3000; ++i)
+    pts.push_back(MakePoint(i, i * 0.5, 10000.0 - i));
+  for (size_t i = 0; i < 3000; ++i)
+    pts.push_back(MakePoint(3, i % 50, i / 50));
+
+  /* Without rebalancing, the diagonal makes a path hundreds of nodes long,
+   * and the plane one of 28. A subtree is rebuilt once a child holds 70% of
+   * it, which bounds the height by about twice log2(n). */
+  KDTree<3, size_t> kd, plane;
+  for (size_t i = 0; i < 3000; ++i)
+    kd.insert(pts[i], i);
+  size_t diagonalHeight = kd.height();
+  for (size_t i = 3000; i < pts.size(); ++i) {
+    kd.insert(pts[i], i);
+    plane.insert(pts[i], i);
+  }
+  CheckCondition(kd.size() == pts.size(), "Every point was inserted.");
+  CheckCondition(diagonalHeight <= 2 * log2(3000.0) + 2, "Sorted inserts keep the tree O(log n) deep.");
+  CheckCondition(plane.height() <= 2 * log2(3000.0) + 2 && kd.height() <= 2 * log2(double(pts.size())) + 2,
+                 "Clustered inserts keep the tree O(log n) deep.");
+
+  bool allFound = true;
+  for (size_t i = 0; i < pts.size(); ++i)
+    allFound = allFound && kd.contains(pts[i]) && kd.at(pts[i]) == i;
+  CheckCondition(allFound, "Every point is found after rebalancing.");
+
+  /* The nearest point to each point is itself, and its neighbors are the
+   * same as those of a brute-force scan.
+   */
+  bool nearestOk = true;
+  vector<KDNeighbor<3, size_t> > found;
+  for (size_t i = 0; i < pts.size(); i += 101) {
+    vector<double> expected;
+    for (size_t j = 0; j < pts.size(); ++j)
+      expected.push_back(Distance(pts[i], pts[j]));
+    sort(expected.begin(), expected.end());
+
+    kd.kNearest(pts[i], 5, found);
+    nearestOk = nearestOk && found.size() == 5 && found[0].value == i;
+    for (size_t j = 0; j < found.size(); ++j)
+      nearestOk = nearestOk && found[j].distance == expected[j];
+  }
+  CheckCondition(nearestOk, "Nearest neighbors are right after rebalancing.");
+
+  /* Erasing in order as well, and then growing again. */
+  for (size_t i = 0; i < pts.size(); i += 2)
+    kd.erase(pts[i]);
+  for (size_t i = 0; i < 2000; ++i)
+    kd.insert(MakePoint(-1.0 * i, 0, 0), i);
+
+  bool afterOk = kd.size() == pts.size() / 2 + 2000;
+  for (size_t i = 1; i < pts.size(); i += 2)
+    afterOk = afterOk && kd.at(pts[i]) == i;
+  for (size_t i = 0; i < 2000; ++i)
+    afterOk = afterOk && kd.at(MakePoint(-1.0 * i, 0, 0)) == i;
+  CheckCondition(afterOk, "Erasing and inserting more keeps every point.");
+
+  EndTest();
+#else
+  TestDisabled("SortedInsertTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks a DynamicKDTree against a brute-force map while points, many of
+ * them repeated, keep arriving, both from this thread and from another one.
+ */
+void DynamicKDTreeTest() try {
+#if DynamicKDTreeTestEnabled
+    PrintBanner("Dynamic KDTree Test");
+
+    /* A tiny buffer so that plenty of trees get built and merged. */
+    DynamicKDTree<2, int> dyn(4, 2);
+    map<Point<2>, int, PointLess> latest;
+    bool allFound = true;
+    for (int i = 0; i < 3000; ++i) {
+      Point<2> pt = MakePoint((i * 37) % 41, (i * 13) % 29);
+      dyn.insert(pt, i);
+      latest[pt] = i;
+      if (i % 250 == 0) {
+        for (map<Point<2>, int, PointLess>::iterator it = latest.begin(); it != latest.end(); ++it)
+          allFound = allFound && dyn.contains(it->first) && dyn.at(it->first) == it->second;
+      }
+    }
+    CheckCondition(allFound, "The newest value of every point is found while merging.");
+
+    /* The neighbors match a brute-force scan over the newest values. */
+    bool nearestOk = true;
+    vector<KDNeighbor<2, int> > found;
+    for (int i = 0; i < 100; ++i) {
+      Point<2> key = MakePoint((i * 7) % 45 - 2.5, (i * 3) % 31 + 0.25);
+      vector<pair<double, int> > expected;
+      for (map<Point<2>, int, PointLess>::iterator it = latest.begin(); it != latest.end(); ++it)
+        expected.push_back(make_pair(Distance(key, it->first), it->second));
+      sort(expected.begin(), expected.end());
+
+      dyn.kNearest(key, 6, found);
+      nearestOk = nearestOk && found.size() == 6;
+      for (size_t j = 0; j < found.size(); ++j) {
+        nearestOk = nearestOk && found[j].distance == expected[j].first &&
+                    found[j].value == latest[found[j].point];
+      }
+    }
+    CheckCondition(nearestOk, "Nearest neighbors only see the newest value of a point.");
+
+    /* Copies of a point count until they are merged, but never fall short. */
+    dyn.flush();
+    bool flushedOk = dyn.size() >= latest.size() && dyn.size() <= 3000;
+    for (map<Point<2>, int, PointLess>::iterator it = latest.begin(); it != latest.end(); ++it)
+      flushedOk = flushedOk && dyn.at(it->first) == it->second;
+    CheckCondition(flushedOk, "Flushing keeps the newest value of every point.");
+
+    /* Points inserted by another thread show up once it is done. */
+    thread producer([&dyn] {
+      for (int i = 0; i < 2000; ++i)
+        dyn.insert(MakePoint(100 + i, 0), i);
+    });
+    for (int i = 0; i < 200; ++i)
+      dyn.kNNValue(MakePoint(100 + i, 1), 3);
+    producer.join();
+
+    bool producedOk = dyn.size() >= latest.size() + 2000;
+    for (int i = 0; i < 2000; ++i)
+      producedOk = producedOk && dyn.at(MakePoint(100 + i, 0)) == i;
+    CheckCondition(producedOk, "Every point inserted by another thread is found.");
+
+    /* maxDistance leaves out points that are too far. */
+    KDSearchOptions options;
+    options.maxDistance = 1.5;
+    dyn.kNearest(MakePoint(2099.5, 0), 5, found, options);
+    CheckCondition(found.size() == 2 && found[0].value == 1999 && found[1].value == 1998,
+                   "Only neighbors within maxDistance are returned.");
+
+    /* The same few points over and over: merged trees stay small, so the
+     * forest must not run out of merges while it is still growing.
+     */
+    DynamicKDTree<2, int> repeated(4, 2);
+    for (int i = 0; i < 20000; ++i)
+      repeated.insert(MakePoint(i % 4, 0), i);
+    repeated.flush();
+    CheckCondition(repeated.size() == 4 && repeated.at(MakePoint(3, 0)) == 19999,
+                   "Inserting the same points again and again never stalls.");
+
+    /* The copies an insert makes to build a full buffer into the only tree. */
+    long sealCopies;
+    {
+      DynamicKDTree<2, ThrowingLabel> probe(16, 1);
+      for (int i = 0; i < 15; ++i)
+        probe.insert(MakePoint(i, 600), ThrowingLabel(i));
+      ThrowingLabel::copiesLeft = 1000000;
+      probe.insert(MakePoint(15, 600), ThrowingLabel(15));
+      sealCopies = 1000000 - ThrowingLabel::copiesLeft;
+      ThrowingLabel::copiesLeft = -1;
+    }
+
+    /* The same build on a forest holding a tree, so that a merge follows and
+     * throws a few copies in.
+     */
+    DynamicKDTree<2, ThrowingLabel> failing(16, 1);
+    for (int i = 0; i < 16; ++i)
+      failing.insert(MakePoint(i, 500), ThrowingLabel(100 + i));
+    failing.flush();
+    for (int i = 0; i < 15; ++i)
+      failing.insert(MakePoint(i, 600), ThrowingLabel(i));
+    ThrowingLabel::copiesLeft = sealCopies + 5;
+    failing.insert(MakePoint(15, 600), ThrowingLabel(15));
+    bool mergeThrew = false;
+    try {
+      failing.flush();
+    } catch (const runtime_error&) {
+      mergeThrew = true;
+    }
+    ThrowingLabel::copiesLeft = -1;
+    failing.flush();
+    bool mergeKept = failing.size() == 32;
+    for (int i = 0; i < 16; ++i)
+      mergeKept = mergeKept && failing.at(MakePoint(i, 500)).id == 100 + i && failing.at(MakePoint(i, 600)).id == i;
+    CheckCondition(mergeThrew && mergeKept, "flush() passes on a failed merge, and the merge is done again after.");
+
+    /* A build that throws in insert keeps the points, and the next full
+     * buffer builds them.
+     */
+    for (int i = 0; i < 15; ++i)
+      failing.insert(MakePoint(i, 700), ThrowingLabel(200 + i));
+    ThrowingLabel::copiesLeft = 3;
+    bool sealThrew = false;
+    try {
+      failing.insert(MakePoint(15, 700), ThrowingLabel(215));
+    } catch (const runtime_error&) {
+      sealThrew = true;
+    }
+    ThrowingLabel::copiesLeft = -1;
+    bool sealKept = true;
+    for (int i = 0; i < 16; ++i)
+      sealKept = sealKept && failing.contains(MakePoint(i, 700)) && failing.at(MakePoint(i, 700)).id == 200 + i;
+    vector<KDNeighbor<2, ThrowingLabel> > sealedNear;
+    failing.kNearest(MakePoint(3.2, 700), 2, sealedNear);
+    sealKept = sealKept && sealedNear.size() == 2 && sealedNear[0].value.id == 203 && sealedNear[1].value.id == 204;
+    CheckCondition(sealThrew && sealKept, "Points of a build that threw are still found.");
+
+    for (int i = 0; i < 16; ++i)
+      failing.insert(MakePoint(i, 800), ThrowingLabel(300 + i));
+    failing.flush();
+    bool rebuiltOk = failing.size() == 64;
+    for (int i = 0; i < 16; ++i)
+      rebuiltOk = rebuiltOk && failing.at(MakePoint(i, 700)).id == 200 + i && failing.at(MakePoint(i, 800)).id == 300 + i;
+    CheckCondition(rebuiltOk, "A later insert builds the points of a build that threw.");
+
+    EndTest();
+#else
+    TestDisabled("DynamicKDTreeTest");
+#endif
+} catch (const exception& e) {
+    FailTest(e);
+}
+
+/* Saves trees to a file and checks that the mapped copy answers every query
+ * the way the tree itself does.
+ */
+void MappedKDTreeTest() try {
+#if MappedKDTreeTestEnabled
+  PrintBanner("Mapped KDTree Test");
+
+  const string filename = "mapped-kdtree-test.kdt";
+
+  /* A lattice with a few points erased, so erased nodes get saved too. */
+  KDTree<3, int> kd;
+  for (int x = 0; x < 12; ++x)
+    for (int y = 0; y < 12; ++y)
+      for (int z = 0; z < 12; ++z)
+        kd.insert(MakePoint(x, y * 1.5, z * 0.5), x * 144 + y * 12 + z);
+  for (int x = 0; x < 12; x += 3)
+    kd.erase(MakePoint(x, 3, 1));
+
+  MappedKDTree<3, int>::save(kd, filename);
+  MappedKDTree<3, int> mapped(filename);
+  CheckCondition(mapped.size() == kd.size() && mapped.dimension() == 3, "Mapped tree has every point.");
+
+  bool lookupsOk = true;
+  for (int x = 0; x < 12; ++x) {
+    Point<3> pt = MakePoint(x, 3, 1);
+    lookupsOk = lookupsOk && mapped.contains(pt) == kd.contains(pt);
+    if (kd.contains(pt)) lookupsOk = lookupsOk && mapped.at(pt) == kd.at(pt);
+  }
+  CheckCondition(lookupsOk, "Mapped tree finds the points left and skips the erased ones.");
+
+  bool nearestOk = true, rangeOk = true;
+  vector<KDNeighbor<3, int> > expected, found;
+  for (int i = 0; i < 100; ++i) {
+    Point<3> key = MakePoint((i * 7) % 13 - 0.5, (i * 5) % 19 * 0.9, (i * 3) % 7 + 0.2);
+    kd.kNearest(key, 8, expected);
+    mapped.kNearest(key, 8, found);
+    nearestOk = nearestOk && found.size() == expected.size() &&
+                mapped.kNNValue(key, 8) == kd.kNNValue(key, 8);
+    for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+      nearestOk = nearestOk && found[j].value == expected[j].value && found[j].distance == expected[j].distance;
+
+    Point<3> hi = MakePoint(key[0] + 3, key[1] + 2, key[2] + 1);
+    vector<KDNeighbor<3, int> > inRadius, expectedInRadius;
+    mapped.radiusSearch(key, 2.5, back_inserter(inRadius));
+    kd.radiusSearch(key, 2.5, back_inserter(expectedInRadius));
+    rangeOk = rangeOk && mapped.rangeCount(key, hi) == kd.rangeCount(key, hi) &&
+              inRadius.size() == expectedInRadius.size();
+  }
+  CheckCondition(nearestOk, "Mapped tree finds the same nearest neighbors.");
+  CheckCondition(rangeOk, "Mapped tree answers range and radius queries the same.");
+
+  /* Moving hands the mapping over. */
+  MappedKDTree<3, int> moved(std::move(mapped));
+  CheckCondition(moved.size() == kd.size() && mapped.empty() && !mapped.contains(MakePoint(1, 1, 1)),
+                 "Moving a mapped tree leaves the old one empty.");
+
+  /* The file records the kind of tree it holds. */
+  bool rejected = false;
+  try {
+    MappedKDTree<2, int> wrong(filename);
+  } catch (const runtime_error&) {
+    rejected = true;
+  }
+  CheckCondition(rejected, "Mapping a file as another kind of tree throws.");
+
+  /* Saving over a mapped file leaves the mapping as it was. */
+  KDTree<3, int> empty;
+  MappedKDTree<3, int>::save(empty, filename);
+  MappedKDTree<3, int> mappedEmpty(filename);
+  CheckCondition(mappedEmpty.empty() && mappedEmpty.kNearest(MakePoint(0, 0, 0), 3, found) == 0,
+                 "An empty tree can be saved and mapped.");
+  CheckCondition(moved.size() == kd.size() && moved.at(MakePoint(1, 3, 2)) == kd.at(MakePoint(1, 3, 2)),
+                 "Saving over a mapped file does not change the mapped tree.");
+  remove(filename.c_str());
+
+  EndTest();
+#else
+  TestDisabled("MappedKDTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks trees with float and fixed-point coordinates against trees and
+ * brute-force scans over the same points as doubles.
+ */
+void CoordinateTypeTest() try {
+#if CoordinateTypeTestEnabled
+  PrintBanner("Coordinate Type Test");
+
+  CheckCondition(sizeof(Point<4, float>) * 2 == sizeof(Point<4>), "Float points take half the memory.");
+
+  /* Coordinates that floats hold exactly, so both trees see the same points. */
+  KDTree<5, int, allocator<int>, float> floatTree;
+  KDTree<5, int> doubleTree;
+  for (int i = 0; i < 3000; ++i) {
+    Point<5, float> pt;
+    Point<5> wide;
+    for (size_t d = 0; d < 5; ++d) {
+      pt[d] = ((i * 37 + d * 101) % 997) / 8.0f;
+      wide[d] = pt[d];
+    }
+    floatTree.insert(pt, i);
+    doubleTree.insert(wide, i);
+  }
+  CheckCondition(floatTree.size() == doubleTree.size(), "Float tree holds every point.");
+
+  bool floatOk = true;
+  vector<KDNeighbor<5, int, float> > found;
+  vector<KDNeighbor<5, int> > expected;
+  for (int i = 0; i < 100; ++i) {
+    Point<5, float> key;
+    Point<5> wideKey;
+    for (size_t d = 0; d < 5; ++d) {
+      key[d] = ((i * 53 + d * 29) % 1000) / 8.0f + 0.25f;
+      wideKey[d] = key[d];
+    }
+    floatTree.kNearest(key, 6, found);
+    doubleTree.kNearest(wideKey, 6, expected);
+    floatOk = floatOk && found.size() == expected.size();
+    for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+      floatOk = floatOk && found[j].distance == expected[j].distance && found[j].value == expected[j].value;
+  }
+  CheckCondition(floatOk, "Float tree finds the same neighbors at the same distances.");
+
+  /* Fixed-point coordinates whose differences overflow 32 bits. */
+  KDTree<2, int, allocator<int>, int32_t> fixedTree;
+  vector<Point<2, int32_t> > fixedPoints;
+  for (int i = 0; i < 2000; ++i) {
+    Point<2, int32_t> pt;
+    pt[0] = int32_t((i * 7919LL) % 4000000000LL - 2000000000LL);
+    pt[1] = int32_t((i * 104729LL) % 3600000000LL - 1800000000LL);
+    fixedTree.insert(pt, i);
+    fixedPoints.push_back(pt);
+  }
+
+  bool fixedOk = fixedTree.size() == fixedPoints.size();
+  vector<KDNeighbor<2, int, int32_t> > fixedFound;
+  for (int i = 0; i < 50; ++i) {
+    Point<2, int32_t> key;
+    key[0] = int32_t(i * 80000000LL - 2000000000LL);
+    key[1] = int32_t(1800000000LL - i * 70000000LL);
+
+    vector<double> distances;
+    for (size_t j = 0; j < fixedPoints.size(); ++j) {
+      double dx = double(key[0]) - double(fixedPoints[j][0]);
+      double dy = double(key[1]) - double(fixedPoints[j][1]);
+      distances.push_back(sqrt(dx * dx + dy * dy));
+    }
+    sort(distances.begin(), distances.end());
+
+    fixedTree.kNearest(key, 4, fixedFound);
+    fixedOk = fixedOk && fixedFound.size() == 4;
+    for (size_t j = 0; j < fixedFound.size(); ++j)
+      fixedOk = fixedOk && fixedFound[j].distance == distances[j];
+  }
+  CheckCondition(fixedOk, "Fixed-point tree finds the nearest points across the whole range.");
+
+  bool fixedLookupsOk = true;
+  for (size_t i = 0; i < fixedPoints.size(); i += 13)
+    fixedLookupsOk = fixedLookupsOk && fixedTree.at(fixedPoints[i]) == int(i);
+  Point<2, int32_t> lo, hi;
+  lo[0] = lo[1] = numeric_limits<int32_t>::min();
+  hi[0] = hi[1] = numeric_limits<int32_t>::max();
+  fixedLookupsOk = fixedLookupsOk && fixedTree.rangeCount(lo, hi) == fixedPoints.size();
+  CheckCondition(fixedLookupsOk, "Fixed-point tree finds every point.");
+
+#ifndef _WIN32
+  /* The file records the coordinate type, not just its size. */
+  const string filename = "coordinate-type-test.kdt";
+  MappedKDTree<5, int, float>::save(floatTree, filename);
+  bool mappedOk = MappedKDTree<5, int, float>(filename).size() == floatTree.size();
+  try {
+    MappedKDTree<5, int, int32_t> wrong(filename);
+    mappedOk = false;
+  } catch (const runtime_error&) {}
+  remove(filename.c_str());
+  CheckCondition(mappedOk, "A float tree maps back only as a float tree.");
+#endif
+
+  EndTest();
+#else
+  TestDisabled("CoordinateTypeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks trees with leaf buckets of several sizes against a map of the same
+ * points, while points are inserted, erased and inserted again, and checks
+ * that bulk-built trees and their mapped copies answer queries the same
+ * whatever their bucket size.
+ */
+void LeafBucketTest() try {
+#if LeafBucketTestEnabled
+  PrintBanner("Leaf Bucket Test");
+
+  const size_t bucketSizes[] = {1, 2, 8, 64};
+  bool lookupsOk = true, nearestOk = true, rangeOk = true;
+  for (size_t b = 0; b < 4; ++b) {
+    KDTree<2, int> kd(KDBuildOptions(1, 32768, bucketSizes[b]));
+    map<pair<double, double>, int> expected;
+    for (int i = 0; i < 4000; ++i) {
+      /* Few distinct coordinates, so buckets fill with equal keys as well. */
+      Point<2> pt = MakePoint((i * 37) % 61, (i * 11) % 23 * 0.5);
+      if (i % 5 == 3) {
+        lookupsOk = lookupsOk && kd.erase(pt) == (expected.erase(make_pair(pt[0], pt[1])) == 1);
+      } else {
+        kd.insert(pt, i);
+        expected[make_pair(pt[0], pt[1])] = i;
+      }
+    }
+    lookupsOk = lookupsOk && kd.size() == expected.size();
+    for (map<pair<double, double>, int>::iterator itr = expected.begin(); itr != expected.end(); ++itr) {
+      Point<2> pt = MakePoint(itr->first.first, itr->first.second);
+      lookupsOk = lookupsOk && kd.contains(pt) && kd.at(pt) == itr->second;
+    }
+
+    vector<KDNeighbor<2, int> > found;
+    for (int i = 0; i < 50; ++i) {
+      Point<2> key = MakePoint((i * 13) % 67 - 2.3, (i * 7) % 13 + 0.1);
+      vector<double> distances;
+      size_t inside = 0;
+      for (map<pair<double, double>, int>::iterator itr = expected.begin(); itr != expected.end(); ++itr) {
+        Point<2> pt = MakePoint(itr->first.first, itr->first.second);
+        distances.push_back(Distance(pt, key));
+        if (pt[0] >= key[0] && pt[0] <= key[0] + 10 && pt[1] >= key[1] && pt[1] <= key[1] + 4) ++inside;
+      }
+      sort(distances.begin(), distances.end());
+      nearestOk = nearestOk && kd.kNearest(key, 7, found) == 7;
+      for (size_t j = 0; j < found.size(); ++j)
+        nearestOk = nearestOk && fabs(found[j].distance - distances[j]) < 1e-9;
+      rangeOk = rangeOk && kd.rangeCount(key, MakePoint(key[0] + 10, key[1] + 4)) == inside;
+    }
+  }
+  CheckCondition(lookupsOk, "Bucketed trees find every point inserted and none erased.");
+  CheckCondition(nearestOk, "Bucketed trees find the nearest neighbors.");
+  CheckCondition(rangeOk, "Bucketed trees count the points in a range.");
+
+  /* The bucket size does not change the answers of a built tree. */
+  vector<pair<Point<3>, int> > data;
+  for (int i = 0; i < 5000; ++i)
+    data.push_back(make_pair(MakePoint(i % 17, (i * 31) % 29 * 0.5, (i * 7) % 1013 * 0.1), i));
+  KDTree<3, int> single(data.begin(), data.end(), KDBuildOptions(1, 32768, 1));
+  KDTree<3, int> bucketed(data.begin(), data.end(), KDBuildOptions(4, 500, 32));
+  bool sameOk = bucketed.size() == single.size();
+  vector<KDNeighbor<3, int> > expected, found;
+  for (int i = 0; i < 100; ++i) {
+    Point<3> key = MakePoint((i * 3) % 19 - 0.5, (i * 5) % 16 + 0.2, (i * 41) % 103 + 0.05);
+    single.kNearest(key, 5, expected);
+    bucketed.kNearest(key, 5, found);
+    sameOk = sameOk && found.size() == expected.size();
+    for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+      sameOk = sameOk && found[j].distance == expected[j].distance;
+
+    Point<3> hi = MakePoint(key[0] + 4, key[1] + 3, key[2] + 20);
+    sameOk = sameOk && bucketed.rangeCount(key, hi) == single.rangeCount(key, hi);
+    sameOk = sameOk && bucketed.at(data[i * 37].first) == i * 37;
+  }
+  CheckCondition(sameOk, "Built trees answer the same whatever their bucket size.");
+
+#ifndef _WIN32
+  /* So does a mapped copy of the bucketed tree. */
+  const string filename = "leaf-bucket-test.kdt";
+  MappedKDTree<3, int>::save(bucketed, filename);
+  MappedKDTree<3, int> mapped(filename);
+  bool mappedOk = mapped.size() == single.size();
+  for (int i = 0; i < 100; ++i) {
+    Point<3> key = MakePoint((i * 3) % 19 - 0.5, (i * 5) % 16 + 0.2, (i * 41) % 103 + 0.05);
+    single.kNearest(key, 5, expected);
+    mapped.kNearest(key, 5, found);
+    mappedOk = mappedOk && found.size() == expected.size();
+    for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+      mappedOk = mappedOk && found[j].distance == expected[j].distance;
+
+    Point<3> hi = MakePoint(key[0] + 4, key[1] + 3, key[2] + 20);
+    mappedOk = mappedOk && mapped.rangeCount(key, hi) == single.rangeCount(key, hi) &&
+               mapped.contains(data[i * 37].first);
+  }
+  remove(filename.c_str());
+  CheckCondition(mappedOk, "A mapped bucketed tree answers the same as well.");
+#endif
+
+  EndTest();
+#else
+  TestDisabled("LeafBucketTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Builds trees over points spread far wider along one axis than the others
+ * with each split rule, in one thread and in several, then inserts and erases
+ * points and checks lookups, nearest neighbors and ranges against brute force.
+ */
+void SplitRuleTest() try {
+#if SplitRuleTestEnabled
+  PrintBanner("Split Rule Test");
+
+  vector<pair<Point<3>, int> > data;
+  for (int i = 0; i < 3000; ++i)
+    data.push_back(make_pair(MakePoint((i * 7919) % 3001 * 0.5, (i * 31) % 17 * 0.01, (i * 13) % 11), i));
+
+  const KDSplitRule rules[] = {KD_SPLIT_CYCLE, KD_SPLIT_MAX_SPREAD, KD_SPLIT_MAX_VARIANCE, KD_SPLIT_SLIDING_MIDPOINT};
+  bool lookupsOk = true, nearestOk = true, rangeOk = true;
+  for (size_t r = 0; r < 4; ++r) {
+    for (size_t threads = 1; threads <= 4; threads += 3) {
+      KDTree<3, int> kd(data.begin(), data.end(), KDBuildOptions(threads, 256, 4, rules[r]));
+      map<int, Point<3> > expected;
+      for (size_t i = 0; i < data.size(); ++i) expected[data[i].second] = data[i].first;
+
+      /* Clustered inserts land in the buckets the rule made; erases leave tombstones. */
+      for (int i = 0; i < 600; ++i) {
+        if (i % 3 == 2) {
+          lookupsOk = lookupsOk && kd.erase(data[i * 4].first);
+          expected.erase(data[i * 4].second);
+        } else {
+          Point<3> pt = MakePoint(700 + i * 0.01, 0.5 + i % 5 * 0.001, 20);
+          kd.insert(pt, 10000 + i);
+          expected[10000 + i] = pt;
+        }
+      }
+      lookupsOk = lookupsOk && kd.size() == expected.size();
+      for (map<int, Point<3> >::iterator itr = expected.begin(); itr != expected.end(); ++itr)
+        lookupsOk = lookupsOk && kd.contains(itr->second) && kd.at(itr->second) == itr->first;
+
+      vector<KDNeighbor<3, int> > found;
+      for (int i = 0; i < 40; ++i) {
+        Point<3> key = MakePoint(i * 41 % 1500 + 0.3, (i % 4) * 0.05, i % 12 + 0.5);
+        Point<3> hi = MakePoint(key[0] + 30, key[1] + 0.1, key[2] + 4);
+        vector<double> distances;
+        size_t inside = 0;
+        for (map<int, Point<3> >::iterator itr = expected.begin(); itr != expected.end(); ++itr) {
+          const Point<3>& pt = itr->second;
+          distances.push_back(Distance(pt, key));
+          if (pt[0] >= key[0] && pt[0] <= hi[0] && pt[1] >= key[1] && pt[1] <= hi[1] &&
+              pt[2] >= key[2] && pt[2] <= hi[2]) ++inside;
+        }
+        sort(distances.begin(), distances.end());
+        nearestOk = nearestOk && kd.kNearest(key, 6, found) == 6;
+        for (size_t j = 0; j < found.size(); ++j)
+          nearestOk = nearestOk && fabs(found[j].distance - distances[j]) < 1e-9;
+        rangeOk = rangeOk && kd.rangeCount(key, hi) == inside;
+      }
+    }
+  }
+  CheckCondition(lookupsOk, "Trees find every point whatever their split rule.");
+  CheckCondition(nearestOk, "Trees find the nearest neighbors whatever their split rule.");
+  CheckCondition(rangeOk, "Trees count the points in a range whatever their split rule.");
+
+  EndTest();
+#else
+  TestDisabled("SplitRuleTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that trees keeping bounding boxes find the same neighbors as trees
+ * without them, with every kind of search, both right after the build and
+ * after points are inserted and erased.
+ */
+void BoundingBoxTest() try {
+#if BoundingBoxTestEnabled
+  PrintBanner("Bounding Box Test");
+
+  vector<pair<Point<6>, int> > data;
+  for (int i = 0; i < 4000; ++i) {
+    Point<6> pt;
+    for (size_t d = 0; d < 6; ++d) pt[d] = (i * (7 + 4 * d) + d * d) % (19 + 6 * d) * (d + 1) * 0.5;
+    data.push_back(make_pair(pt, i));
+  }
+  KDTree<6, int> plain(data.begin(), data.end(), KDBuildOptions(1, 32768, 4));
+  KDTree<6, int> boxed(data.begin(), data.end(), KDBuildOptions(4, 500, 4, KD_SPLIT_MAX_SPREAD, true));
+
+  KDSearchOptions bestBin;
+  bestBin.bestBinFirst = true;
+  KDSearchOptions approximate(0.5);
+  bool nearestOk = true, approximateOk = true;
+  for (int round = 0; round < 2; ++round) {
+    vector<KDNeighbor<6, int> > expected, found;
+    for (int i = 0; i < 60; ++i) {
+      Point<6> key;
+      for (size_t d = 0; d < 6; ++d) key[d] = (i * (3 + d) + d) % (23 + 6 * d) * (d + 1) * 0.45 - 1 + round * (i % 2) * 40;
+      plain.kNearest(key, 9, expected);
+      for (int kind = 0; kind < 2; ++kind) {
+        boxed.kNearest(key, 9, found, kind == 0 ? KDSearchOptions() : bestBin);
+        nearestOk = nearestOk && found.size() == expected.size();
+        for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+          nearestOk = nearestOk && found[j].distance == expected[j].distance;
+      }
+      boxed.kNearest(key, 9, found, approximate);
+      approximateOk = approximateOk && found.size() == expected.size();
+      for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+        approximateOk = approximateOk && found[j].distance <= 1.5 * expected[j].distance + 1e-9;
+    }
+
+    /* Inserts grow the boxes and erases leave them as they are. */
+    for (int i = 0; i < 1500; ++i) {
+      if (i % 4 == 0) {
+        plain.erase(data[i * 2].first);
+        boxed.erase(data[i * 2].first);
+      } else {
+        Point<6> pt;
+        for (size_t d = 0; d < 6; ++d) pt[d] = 40 + (i * (5 + d)) % 29 * (d + 1) * 0.3;
+        plain.insert(pt, 10000 + i);
+        boxed.insert(pt, 10000 + i);
+      }
+    }
+    boxed = KDTree<6, int>(boxed);
+  }
+  CheckCondition(nearestOk && boxed.size() == plain.size(), "Bounding boxes leave the nearest neighbors found the same.");
+  CheckCondition(approximateOk, "Approximate searches stay within their bound with bounding boxes.");
+
+  EndTest();
+#else
+  TestDisabled("BoundingBoxTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Counts the blocks allocated with the global operator new, which searches
+ * given a warm query context must not ask for. Every form of new and delete
+ * is replaced, so they all agree on where blocks come from.
+ */
+static atomic<size_t> globalAllocations(0);
+
+/* GCC takes the free calls below for a mismatch once the replaced operators
+ * are inlined, although every block they free came from malloc. */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  ++globalAllocations;
+  return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size) {
+  void *block = operator new(size, nothrow);
+  if (block == NULL) throw bad_alloc();
+  return block;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return operator new(size, nothrow);
+}
+
+void operator delete(void* block) noexcept {
+  free(block);
+}
+
+void operator delete[](void* block) noexcept {
+  free(block);
+}
+
+void operator delete(void* block, const nothrow_t&) noexcept {
+  free(block);
+}
+
+void operator delete[](void* block, const nothrow_t&) noexcept {
+  free(block);
+}
+
+/* C++14 passes the size to delete where it knows it. */
+void operator delete(void* block, size_t) noexcept {
+  operator delete(block);
+}
+
+void operator delete[](void* block, size_t) noexcept {
+  operator delete[](block);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+/* Checks that searches run in a query context find what the other searches
+ * do, and that once the context is warm they allocate nothing.
+ */
+void QueryContextTest() try {
+#if QueryContextTestEnabled
+  PrintBanner("Query Context Test");
+
+  vector<pair<Point<3>, int> > data;
+  for (int i = 0; i < 3000; ++i)
+    data.push_back(make_pair(MakePoint((i * 37) % 101, (i * 11) % 53 * 0.7, (i * 5) % 29 * 1.3), i % 7));
+  KDTree<3, int> kd(data.begin(), data.end());
+  KDTree<3, int> boxed(data.begin(), data.end(), KDBuildOptions(1, 32768, 8, KD_SPLIT_CYCLE, true));
+
+  KDSearchOptions bestBin;
+  bestBin.bestBinFirst = true;
+  KNNQueryContext context;
+  vector<KDNeighbor<3, int> > expected, found;
+  bool sameOk = true;
+  for (int i = 0; i < 100; ++i) {
+    Point<3> key = MakePoint((i * 13) % 97 + 0.5, (i * 7) % 41 * 0.9, (i * 3) % 31 + 0.2);
+    size_t k = 1 + i % 15;
+    const KDSearchOptions& options = i % 2 == 0 ? KDSearchOptions() : bestBin;
+    const KDTree<3, int>& tree = i % 3 == 0 ? boxed : kd;
+    tree.kNearest(key, k, expected, options);
+    tree.kNearest(key, k, found, context, options);
+    sameOk = sameOk && found.size() == expected.size() &&
+             tree.kNNValue(key, k, context, options) == tree.kNNValue(key, k, options);
+    for (size_t j = 0; j < found.size() && j < expected.size(); ++j)
+      sameOk = sameOk && found[j].value == expected[j].value && found[j].distance == expected[j].distance;
+  }
+  CheckCondition(sameOk, "Searches in a query context find the same neighbors and values.");
+
+  /* The first round grows the buffers as far as these searches need, and
+   * the second round runs them again without allocating. */
+  size_t allocations[2];
+  int checksum = 0;
+  for (int round = 0; round < 2; ++round) {
+    size_t before = globalAllocations;
+    for (int i = 0; i < 200; ++i) {
+      Point<3> key = MakePoint((i * 17) % 89 - 0.5, (i * 5) % 37, (i * 7) % 23 * 1.1);
+      size_t k = 1 + i % 15;
+      const KDSearchOptions& options = i % 2 == 0 ? KDSearchOptions() : bestBin;
+      const KDTree<3, int>& tree = i % 3 == 0 ? boxed : kd;
+      checksum += tree.kNNValue(key, k, context, options);
+      checksum += int(tree.kNearest(key, k, found, context, options));
+    }
+    allocations[round] = globalAllocations - before;
+  }
+  CheckCondition(allocations[1] == 0 && checksum > 0, "Searches in a warm query context allocate nothing.");
+
+  EndTest();
+#else
+  TestDisabled("QueryContextTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* A label that counts how many times labels are copied. The merge threads
+ * of a DynamicKDTree copy labels too, so the count is atomic. */
+struct CountedLabel {
+  static atomic<size_t> copies;
+  string name;
+
+  CountedLabel() {}
+  explicit CountedLabel(const string& name) : name(name) {}
+  CountedLabel(const CountedLabel& rhs) : name(rhs.name) { ++copies; }
+  CountedLabel& operator=(const CountedLabel& rhs) {
+    name = rhs.name;
+    ++copies;
+    return *this;
+  }
+  bool operator<(const CountedLabel& rhs) const { return name < rhs.name; }
+  bool operator==(const CountedLabel& rhs) const { return name == rhs.name; }
+};
+
+atomic<size_t> CountedLabel::copies(0);
+
+/* Checks that searches copy only the values they return, however many
+ * points they visit, in a KDTree as well as across a DynamicKDTree forest.
+ */
+void PayloadCopyTest() try {
+#if PayloadCopyTestEnabled
+  PrintBanner("Payload Copy Test");
+
+  const char* names[] = {"harbor", "meadow", "summit", "canyon", "delta"};
+  vector<pair<Point<2>, CountedLabel> > data;
+  for (int i = 0; i < 2000; ++i)
+    data.push_back(make_pair(MakePoint(sin(i * 1.7) * 100, cos(i * 2.3) * 100),
+                             CountedLabel(string(names[i % 5]) + " label long enough to live on the heap")));
+
+  KDTree<2, CountedLabel> kd(data.begin(), data.end());
+  /* The buffer size divides the number of points, so once the merges are
+   * done every point is in a tree and none is left in the buffer. */
+  DynamicKDTree<2, CountedLabel> dyn(50, 1);
+  for (size_t i = 0; i < data.size(); ++i)
+    dyn.insert(data[i].first, data[i].second);
+  dyn.flush();
+
+  vector<KDNeighbor<2, CountedLabel> > found;
+  bool sameOk = true, treeCopiesOk = true, forestCopiesOk = true;
+  for (int i = 0; i < 100; ++i) {
+    Point<2> key = MakePoint((i * 37) % 200 - 100.5, (i * 53) % 200 - 99.5);
+    size_t k = 1 + i % 20;
+
+    vector<double> expected;
+    for (size_t j = 0; j < data.size(); ++j)
+      expected.push_back(Distance(data[j].first, key));
+    sort(expected.begin(), expected.end());
+
+    size_t before = CountedLabel::copies;
+    CountedLabel value = kd.kNNValue(key, k);
+    treeCopiesOk = treeCopiesOk && CountedLabel::copies - before <= 1;
+    before = CountedLabel::copies;
+    sameOk = sameOk && dyn.kNNValue(key, k) == value;
+    forestCopiesOk = forestCopiesOk && CountedLabel::copies - before <= 1;
+
+    before = CountedLabel::copies;
+    dyn.kNearest(key, k, found);
+    forestCopiesOk = forestCopiesOk && CountedLabel::copies - before <= k;
+    sameOk = sameOk && found.size() == k;
+    for (size_t j = 0; j < found.size(); ++j)
+      sameOk = sameOk && found[j].distance == expected[j];
+
+    before = CountedLabel::copies;
+    kd.kNearest(key, k, found);
+    treeCopiesOk = treeCopiesOk && CountedLabel::copies - before <= k;
+  }
+  CheckCondition(sameOk, "The forest finds the same neighbors and values as the tree.");
+  CheckCondition(treeCopiesOk, "KDTree searches copy only the values they return.");
+  CheckCondition(forestCopiesOk, "DynamicKDTree searches copy only the values they return.");
+
+  EndTest();
+#else
+  TestDisabled("PayloadCopyTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that frozen trees in both layouts hold exactly the points of the
+ * KDTree they were made from, with their values. Integer coordinates from a
+ * small range tie with the keys of the inner nodes all the time.
+ */
+void FrozenKDTreeTest() try {
+#if FrozenKDTreeTestEnabled
+  PrintBanner("Frozen KDTree Test");
+
+  KDTree<3, int, allocator<int>, int> kd;
+  for (int i = 0; i < 1500; ++i) {
+    Point<3, int> pt;
+    pt[0] = (i * 7) % 11;
+    pt[1] = (i * 13) % 17;
+    pt[2] = i % 9;
+    kd.insert(pt, i);
+  }
+  for (int i = 0; i < 1500; i += 4) {
+    Point<3, int> pt;
+    pt[0] = i % 11;
+    pt[1] = (i * 3) % 17;
+    pt[2] = (i * 5) % 9;
+    kd.erase(pt);
+  }
+
+  FrozenKDTree<3, int, int> none(KDTree<3, int, allocator<int>, int>(), KD_LAYOUT_VEB);
+  Point<3, int> origin;
+  origin[0] = origin[1] = origin[2] = 0;
+  CheckCondition(none.empty() && !none.contains(origin), "A frozen empty tree holds nothing.");
+
+  const KDLayout layouts[] = {KD_LAYOUT_BFS, KD_LAYOUT_VEB};
+  const size_t buckets[] = {1, 3, 8, 64};
+  bool sizeOk = true, sameOk = true, throwsOk = true;
+  for (size_t l = 0; l < 2; ++l) {
+    for (size_t b = 0; b < 4; ++b) {
+      FrozenKDTree<3, int, int> frozen(kd, layouts[l], buckets[b]);
+      sizeOk = sizeOk && frozen.size() == kd.size() && frozen.layout() == layouts[l];
+      for (int x = -1; x <= 11; ++x) {
+        for (int y = -1; y <= 17; ++y) {
+          for (int z = -1; z <= 9; ++z) {
+            Point<3, int> pt;
+            pt[0] = x;
+            pt[1] = y;
+            pt[2] = z;
+            sameOk = sameOk && frozen.contains(pt) == kd.contains(pt);
+            if (kd.contains(pt)) {
+              sameOk = sameOk && frozen.at(pt) == kd.at(pt);
+            } else {
+              try {
+                frozen.at(pt);
+                throwsOk = false;
+              } catch (const out_of_range&) {}
+            }
+          }
+        }
+      }
+    }
+  }
+  CheckCondition(sizeOk, "Frozen trees hold as many points as the tree.");
+  CheckCondition(sameOk, "Frozen trees hold the same points and values as the tree.");
+  CheckCondition(throwsOk, "Frozen trees throw for points they do not hold.");
+
+  EndTest();
+#else
+  TestDisabled("FrozenKDTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Sums the squared differences of two points one coordinate at a time, the
+ * way every distance kernel must add them up. */
+template <size_t N, typename T>
+double ReferenceSquaredDistance(const Point<N, T>& one, const Point<N, T>& two) {
+  double result = 0.0;
+  for (size_t i = 0; i < N; ++i) {
+    double diff = double(int64_t(one[i]) - int64_t(two[i]));
+    if (!is_integral<T>::value) diff = double(one[i]) - double(two[i]);
+    result += diff * diff;
+  }
+  return result;
+}
+
+/* Checks the distance and equality kernels for small dimensions against a
+ * plain loop: the ones written out for integer coordinates up to four, and
+ * the SIMD ones up to three, where they add up in the same order. Also
+ * checks a 3-D tree with fixed-point coordinates against brute force.
+ */
+template <size_t N, typename T>
+bool SmallKernelsAgree(T scale) {
+  bool ok = true;
+  for (int i = 0; i < 200; ++i) {
+    Point<N, T> one, two;
+    for (size_t d = 0; d < N; ++d) {
+      one[d] = T(((i * 7919 + int(d) * 104729) % 20011 - 10005) * scale);
+      two[d] = T(((i * 6271 + int(d) * 3571) % 19997 - 9998) * scale);
+    }
+    ok = ok && SquaredDistance(one, two) == ReferenceSquaredDistance(one, two);
+    ok = ok && one == one && !(one == two);
+
+    /* Points that differ only in their last coordinate */
+    two = one;
+    two[N - 1] = T(two[N - 1] + 1);
+    ok = ok && !(one == two) && one != two && SquaredDistance(one, two) == 1.0;
+  }
+  return ok;
+}
+
+void SmallDimensionTest() try {
+#if SmallDimensionTestEnabled
+  PrintBanner("Small Dimension Test");
+
+  bool integerOk = SmallKernelsAgree<2, int32_t>(200000) && SmallKernelsAgree<3, int32_t>(200000) &&
+                   SmallKernelsAgree<4, int32_t>(200000) && SmallKernelsAgree<2, int16_t>(1) &&
+                   SmallKernelsAgree<3, int64_t>(1000000000) && SmallKernelsAgree<4, int64_t>(1000000000);
+  CheckCondition(integerOk, "Integer kernels for two to four coordinates sum like a plain loop.");
+  bool floatingOk = SmallKernelsAgree<2, double>(0.125) && SmallKernelsAgree<3, double>(0.125) &&
+                    SmallKernelsAgree<2, float>(0.5f) && SmallKernelsAgree<3, float>(0.5f);
+  CheckCondition(floatingOk, "Floating point kernels for two and three coordinates sum like a plain loop.");
+
+  /* Degrees scaled by 10^7, far enough apart to overflow 32-bit differences */
+  vector<pair<Point<3, int32_t>, int> > data;
+  for (int i = 0; i < 2000; ++i) {
+    Point<3, int32_t> pt;
+    pt[0] = int32_t((i * 7919 % 3600) - 1800) * 1000000;
+    pt[1] = int32_t((i * 104729 % 1800) - 900) * 1000000;
+    pt[2] = int32_t(i % 13) * 1000000;
+    data.push_back(make_pair(pt, i));
+  }
+  KDTree<3, int, allocator<int>, int32_t> kd;
+  for (size_t i = 0; i < data.size(); ++i)
+    kd.insert(data[i].first, data[i].second);
+  KDTree<2, int> flat;
+  CheckCondition(kd.dimension() == 3 && flat.dimension() == 2, "Trees report their dimension.");
+
+  bool nearestOk = true;
+  vector<KDNeighbor<3, int, int32_t> > found;
+  for (int i = 0; i < 50; ++i) {
+    Point<3, int32_t> key;
+    key[0] = int32_t((i * 311 % 3600) - 1800) * 1000000 + 12345;
+    key[1] = int32_t((i * 577 % 1800) - 900) * 1000000 - 6789;
+    key[2] = int32_t(i % 7) * 1500000;
+
+    vector<double> expected;
+    for (size_t j = 0; j < data.size(); ++j)
+      expected.push_back(Distance(data[j].first, key));
+    sort(expected.begin(), expected.end());
+
+    kd.kNearest(key, 5, found);
+    nearestOk = nearestOk && found.size() == 5;
+    for (size_t j = 0; j < found.size(); ++j)
+      nearestOk = nearestOk && found[j].distance == expected[j] && kd.contains(found[j].point);
+  }
+  CheckCondition(nearestOk, "A 3-D fixed-point tree finds the nearest points.");
+
+  EndTest();
+#else
+  TestDisabled("SmallDimensionTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Reference for BoundedPQueueTest: a list kept sorted by priority and then
+ * by value, where each value is the number of the enqueue that added it.
+ * Entries past maxSize fall off the end.
+ */
+void ReferenceEnqueue(vector<pair<double, int> >& reference, size_t maxSize, double priority, int value) {
+  pair<double, int> entry(priority, value);
+  reference.insert(upper_bound(reference.begin(), reference.end(), entry), entry);
+  if (reference.size() > maxSize) reference.pop_back();
+}
+
+/* Checks the bounded priority queue against a sorted reference, with plenty
+ * of equal priorities.
+ */
+void BoundedPQueueTest() try {
+#if BoundedPQueueTestEnabled
+  PrintBanner("Bounded Priority Queue Test");
+
+  BoundedPQueue<int> bpq(8);
+  vector<pair<double, int> > reference;
+  CheckCondition(bpq.empty() && bpq.maxSize() == 8 && bpq.best() == numeric_limits<double>::infinity(),
+                 "New queue is empty.");
+
+  /* Priorities from 0 to 4, so each one is enqueued many times. */
+  int enqueued = 0;
+  bool bestOk = true;
+  for (; enqueued < 40; ++enqueued) {
+    double priority = (enqueued * 7) % 5;
+    bpq.enqueue(enqueued, priority);
+    ReferenceEnqueue(reference, 8, priority, enqueued);
+    bestOk = bestOk && bpq.size() == reference.size() &&
+             bpq.best() == reference.front().first && bpq.worst() == reference.back().first;
+  }
+  CheckCondition(bestOk, "best() and worst() are right before anything is dequeued.");
+
+  /* Take half out, then enqueue more before taking out the rest. */
+  bool orderOk = true;
+  for (int i = 0; i < 4; ++i) {
+    orderOk = orderOk && bpq.dequeueMin() == reference.front().second;
+    reference.erase(reference.begin());
+  }
+  CheckCondition(orderOk, "Equal priorities come out first in, first out.");
+
+  for (; enqueued < 60; ++enqueued) {
+    double priority = (enqueued * 3) % 4 + 0.5;
+    bpq.enqueue(enqueued, priority);
+    ReferenceEnqueue(reference, 8, priority, enqueued);
+    bestOk = bestOk && bpq.best() == reference.front().first;
+  }
+  CheckCondition(bestOk && bpq.size() == reference.size(), "best() is right after enqueues that follow a dequeue.");
+
+  vector<int> dequeued, expected;
+  while (!bpq.empty())
+    dequeued.push_back(bpq.dequeueMin());
+  for (size_t i = 0; i < reference.size(); ++i)
+    expected.push_back(reference[i].second);
+  CheckCondition(dequeued == expected, "Dequeue order matches the reference after a later enqueue.");
+
+  /* A full queue of ties keeps the oldest entries and ejects the new one. */
+  BoundedPQueue<int> ties(3);
+  for (int i = 0; i < 6; ++i)
+    ties.enqueue(i, 1.0);
+  bool tiesOk = ties.size() == 3;
+  for (int i = 0; i < 3; ++i)
+    tiesOk = tiesOk && ties.dequeueMin() == i;
+  CheckCondition(tiesOk, "Among equal priorities the newest entry is ejected first.");
+
+  bpq.enqueue(100, 1.0);
+  bpq.reset(3);
+  CheckCondition(bpq.empty() && bpq.maxSize() == 3 && bpq.best() == numeric_limits<double>::infinity(),
+                 "reset() empties the queue and sets its new size.");
+  for (int i = 0; i < 5; ++i)
+    bpq.enqueue(i, 5.0 - i);
+  CheckCondition(bpq.size() == 3 && bpq.best() == 1.0 && bpq.worst() == 3.0, "A reset queue keeps only the new maximum.");
+  bpq.reset(20);
+  for (int i = 0; i < 20; ++i)
+    bpq.enqueue(i, 2.0);
+  bool grownOk = bpq.size() == 20;
+  for (int i = 0; i < 20; ++i)
+    grownOk = grownOk && bpq.dequeueMin() == i;
+  CheckCondition(grownOk, "A queue reset to a larger size holds that many, first in, first out.");
+
+  EndTest();
+#else
+  TestDisabled("BoundedPQueueTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
 /* Main entry point simply runs all the tests.  Note that these functions might be no-ops
  * if they are disabled by the configuration settings at the top of the program.
  */
@@ -796,13 +2642,36 @@ int main() {
   /* Step Three Tests */
   NearestNeighborTest();
   MoreNearestNeighborTest();
+  BatchNearestNeighborTest();
+  ApproximateNeighborTest();
+  BestBinFirstTest();
+
+  /* Range Query Tests */
+  RangeQueryTest();
+  RadiusSearchTest();
 
 //  /* Step Four Tests */
   BasicCopyTest();
   ModerateCopyTest();
+  AllocatorTest();
+  MoveTest();
+  EraseTest();
+  SortedInsertTest();
 
   /* Step Five Tests */
   BunchConstructTest();
+  ParallelBuildTest();
+  DynamicKDTreeTest();
+  MappedKDTreeTest();
+  CoordinateTypeTest();
+  LeafBucketTest();
+  SplitRuleTest();
+  BoundingBoxTest();
+  QueryContextTest();
+  PayloadCopyTest();
+  FrozenKDTreeTest();
+  SmallDimensionTest();
+  BoundedPQueueTest();
 
 #if (BasicKDTreeTestEnabled && \
      ModerateKDTreeTestEnabled && \
@@ -813,9 +2682,30 @@ int main() {
      ConstKDTreeTestEnabled && \
      NearestNeighborTestEnabled &&  \
      MoreNearestNeighborTestEnabled && \
+     BatchNearestNeighborTestEnabled && \
+     ApproximateNeighborTestEnabled && \
+     BestBinFirstTestEnabled && \
+     RangeQueryTestEnabled && \
+     RadiusSearchTestEnabled && \
      BasicCopyTestEnabled && \
      ModerateCopyTestEnabled && \
-     BunchConstrucEnabled)
+     AllocatorTestEnabled && \
+     MoveTestEnabled && \
+     EraseTestEnabled && \
+     SortedInsertTestEnabled && \
+     BunchConstrucEnabled && \
+     ParallelBuildTestEnabled && \
+     DynamicKDTreeTestEnabled && \
+     MappedKDTreeTestEnabled && \
+     CoordinateTypeTestEnabled && \
+     LeafBucketTestEnabled && \
+     SplitRuleTestEnabled && \
+     BoundingBoxTestEnabled && \
+     QueryContextTestEnabled && \
+     PayloadCopyTestEnabled && \
+     FrozenKDTreeTestEnabled && \
+     SmallDimensionTestEnabled && \
+     BoundedPQueueTestEnabled)
   cout << "All tests completed!  If they passed, you should be good to go!" << endl << endl;
 #else
   cout << "Not all tests were run.  Enable the rest of the tests, then run again." << endl << endl;